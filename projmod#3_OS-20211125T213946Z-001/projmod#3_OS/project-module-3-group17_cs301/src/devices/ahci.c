@@ -0,0 +1,632 @@
+#include "devices/ahci.h"
+#include <ctype.h>
+#include <debug.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file is an interface to SATA disks behind an
+   AHCI host controller, e.g. QEMU's "-device ahci" or the
+   controller built into its "q35" machine.  See the "Serial ATA
+   Advanced Host Controller Interface (AHCI)" specification,
+   revision 1.3, and [ATA-8] for the commands.
+
+   Each port has 32 command slots.  If the disk supports native
+   command queuing (NCQ), the driver starts a request in a free
+   slot as soon as it is given one, so the disk can work on up to
+   32 of them at once and complete them in any order.  Otherwise it
+   uses one slot and has one command in flight at a time, like the
+   IDE driver. */
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+#define PCI_SATA_AHCI 0x01
+
+/* Generic host control registers, relative to ABAR (BAR 5). */
+#define HBA_CAP 0x00            /* Capabilities. */
+#define HBA_GHC 0x04            /* Global host control. */
+#define HBA_IS 0x08             /* Interrupt status, one bit per port. */
+#define HBA_PI 0x0c             /* Ports implemented. */
+#define HBA_SIZE 0x1100         /* Through the last port's registers. */
+
+#define CAP_SNCQ 0x40000000     /* Supports NCQ. */
+#define CAP_NCS(CAP) ((((CAP) >> 8) & 0x1f) + 1) /* Command slots. */
+#define GHC_AE 0x80000000       /* AHCI enable. */
+#define GHC_IE 0x00000002       /* Interrupt enable. */
+
+/* Port registers, relative to the port's base. */
+#define PORT_CLB 0x00           /* Command list base address. */
+#define PORT_CLBU 0x04
+#define PORT_FB 0x08            /* FIS receive area base address. */
+#define PORT_FBU 0x0c
+#define PORT_IS 0x10            /* Interrupt status. */
+#define PORT_IE 0x14            /* Interrupt enable. */
+#define PORT_CMD 0x18           /* Command and status. */
+#define PORT_TFD 0x20           /* Task file data. */
+#define PORT_SIG 0x24           /* Signature. */
+#define PORT_SSTS 0x28          /* SATA status. */
+#define PORT_SERR 0x30          /* SATA error. */
+#define PORT_SACT 0x34          /* SATA active: queued commands. */
+#define PORT_CI 0x38            /* Command issue. */
+
+#define PORT_IS_DHRS 0x00000001 /* Device to host register FIS. */
+#define PORT_IS_SDBS 0x00000008 /* Set device bits FIS (NCQ done). */
+#define PORT_IS_TFES 0x40000000 /* Task file error. */
+
+#define PORT_CMD_ST 0x0001      /* Start processing the command list. */
+#define PORT_CMD_FRE 0x0010     /* FIS receive enable. */
+#define PORT_CMD_FR 0x4000      /* FIS receive running. */
+#define PORT_CMD_CR 0x8000      /* Command list running. */
+
+#define SIG_ATA 0x00000101      /* Signature of an ATA disk. */
+
+/* Task file status bits, the same as the IDE alternate status
+   register's. */
+#define STA_BSY 0x80
+#define STA_DRQ 0x08
+#define STA_ERR 0x01
+
+/* ATA commands. */
+#define CMD_IDENTIFY_DEVICE 0xec
+#define CMD_READ_DMA_EXT 0x25
+#define CMD_WRITE_DMA_EXT 0x35
+#define CMD_READ_FPDMA_QUEUED 0x60
+#define CMD_WRITE_FPDMA_QUEUED 0x61
+
+#define FIS_TYPE_REG_H2D 0x27   /* Register FIS, host to device. */
+#define DEV_LBA 0x40            /* Device register: LBA addressing. */
+
+/* Command list entry. */
+struct cmd_header
+  {
+    uint16_t flags;             /* FIS length in dwords; CMD_H_*. */
+    uint16_t prdtl;             /* Entries in the PRD table. */
+    uint32_t prdbc;             /* Bytes transferred. */
+    uint32_t ctba, ctbau;       /* Command table address. */
+    uint32_t reserved[4];
+  };
+
+#define CMD_H_WRITE 0x0040      /* Host to device. */
+
+/* Physical region descriptor. */
+struct prd
+  {
+    uint32_t dba, dbau;         /* Data address. */
+    uint32_t reserved;
+    uint32_t dbc;               /* Bytes - 1; PRD_INTR. */
+  };
+
+#define PRD_MAX_BYTES (4 * 1024 * 1024)
+
+/* Command table.  Data buffers are physically contiguous, so one
+   PRD is enough; the rest pads it to the 128-byte alignment the
+   next table needs. */
+struct cmd_table
+  {
+    uint8_t cfis[64];           /* Command FIS. */
+    uint8_t acmd[16];           /* ATAPI command, unused. */
+    uint8_t reserved[48];
+    struct prd prdt[1];
+    uint8_t pad[112];
+  };
+
+#define SLOT_CNT 32             /* Command slots per port. */
+
+/* A host controller. */
+struct ahci_hba
+  {
+    volatile uint8_t *abar;     /* Mapped registers. */
+  };
+
+/* A port with a disk attached. */
+struct ahci_port
+  {
+    char name[8];               /* Name, e.g. "sda". */
+    struct ahci_hba *hba;       /* Controller. */
+    int port_no;                /* Port on the controller. */
+    volatile uint8_t *regs;     /* Mapped port registers. */
+    block_sector_t capacity;    /* Size in sectors. */
+    char extra_info[128];       /* Model and serial number. */
+
+    /* Command list, received FISes, and command tables, in
+       PORT_PAGES pages from palloc. */
+    struct cmd_header *cmd_list;
+    uint8_t *fis;
+    struct cmd_table *tables;
+
+    /* Slots in use.  BUSY, ISSUED and REQS are protected by
+       disabling interrupts, since the interrupt handler releases
+       slots. */
+    bool ncq;                   /* Queue commands? */
+    size_t slot_cnt;            /* Slots to use, 1 without NCQ. */
+    uint32_t busy;              /* Bit for each slot in use. */
+    uint32_t issued;            /* Bit for each slot given to the disk. */
+    struct block_request *reqs[SLOT_CNT];
+    struct semaphore free_slots; /* Up once per free slot. */
+  };
+
+#define PORT_PAGES 3
+
+#define hba_reg(H, REG) (*(volatile uint32_t *) ((H)->abar + (REG)))
+#define port_reg(P, REG) (*(volatile uint32_t *) ((P)->regs + (REG)))
+
+/* Most controllers and disks supported. */
+#define HBA_MAX 2
+#define PORT_MAX 8
+
+static struct ahci_hba hbas[HBA_MAX];
+static size_t hba_cnt;
+static struct ahci_port ports[PORT_MAX];
+static size_t port_cnt;
+
+static struct block_operations ahci_operations;
+
+static void probe_hba (struct ahci_hba *);
+static bool setup_port (struct ahci_port *);
+static bool stop_port (struct ahci_port *);
+static bool identify_device (struct ahci_port *);
+static char *descramble_ata_string (char *, int size);
+static void fill_command (struct ahci_port *, size_t slot, uint8_t command,
+                          block_sector_t, size_t cnt, void *buffer,
+                          size_t size, bool write);
+static void interrupt_handler (struct intr_frame *);
+
+/* Finds the AHCI controllers on the PCI bus and registers the
+   disks attached to them, and their partitions, as block
+   devices. */
+void
+ahci_init (void)
+{
+  struct pci_device *pd = NULL;
+  size_t first_port, i;
+
+  while ((pd = pci_find_class (PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, pd))
+         != NULL)
+    {
+      struct ahci_hba *h;
+
+      if (pd->prog_if != PCI_SATA_AHCI)
+        continue;
+      if (hba_cnt >= HBA_MAX)
+        {
+          printf ("ahci: ignoring controllers after the first %d\n",
+                  HBA_MAX);
+          break;
+        }
+      if (PCI_BAR_MEM (pd->bar[5]) == 0 || pd->irq >= 16)
+        {
+          printf ("ahci: controller without registers or interrupt\n");
+          continue;
+        }
+
+      h = &hbas[hba_cnt++];
+      h->abar = pci_map_mem (PCI_BAR_MEM (pd->bar[5]), HBA_SIZE);
+      pci_enable (pd, PCI_CMD_MEM | PCI_CMD_MASTER);
+      hba_reg (h, HBA_GHC) |= GHC_AE;
+
+      first_port = port_cnt;
+      probe_hba (h);
+
+      /* Enable interrupts and register the disks found. */
+      pci_register_handler (pd, interrupt_handler, "ahci");
+      hba_reg (h, HBA_IS) = hba_reg (h, HBA_IS);
+      hba_reg (h, HBA_GHC) |= GHC_IE;
+      for (i = first_port; i < port_cnt; i++)
+        {
+          struct ahci_port *p = &ports[i];
+          struct block *block;
+
+          block = block_register (p->name, BLOCK_RAW, p->extra_info,
+                                  p->capacity, &ahci_operations, p);
+          partition_scan (block);
+        }
+    }
+}
+
+/* Sets up each implemented port of controller H that has an ATA
+   disk attached. */
+static void
+probe_hba (struct ahci_hba *h)
+{
+  uint32_t implemented = hba_reg (h, HBA_PI);
+  int port_no;
+
+  for (port_no = 0; port_no < 32; port_no++)
+    {
+      struct ahci_port *p;
+      uint32_t ssts;
+
+      if (!(implemented & (1u << port_no)))
+        continue;
+      if (port_cnt >= PORT_MAX)
+        {
+          printf ("ahci: ignoring disks after the first %d\n", PORT_MAX);
+          return;
+        }
+
+      p = &ports[port_cnt];
+      snprintf (p->name, sizeof p->name, "sd%c", (int) ('a' + port_cnt));
+      p->hba = h;
+      p->port_no = port_no;
+      p->regs = h->abar + 0x100 + port_no * 0x80;
+
+      /* A device must be present with the link up, and be a disk
+         rather than, say, a CD-ROM drive. */
+      ssts = port_reg (p, PORT_SSTS);
+      if ((ssts & 0xf) != 3 || ((ssts >> 8) & 0xf) != 1
+          || port_reg (p, PORT_SIG) != SIG_ATA)
+        continue;
+
+      if (setup_port (p))
+        port_cnt++;
+    }
+}
+
+/* Sets up the command list of port P and identifies its disk.
+   Returns true if successful, false if P cannot be used. */
+static bool
+setup_port (struct ahci_port *p)
+{
+  uint8_t *pages;
+  uint32_t cap = hba_reg (p->hba, HBA_CAP);
+  size_t i;
+
+  if (!stop_port (p))
+    {
+      printf ("%s: port does not stop\n", p->name);
+      return false;
+    }
+
+  pages = palloc_get_multiple (PAL_ZERO, PORT_PAGES);
+  if (pages == NULL)
+    {
+      printf ("%s: out of memory for command list\n", p->name);
+      return false;
+    }
+  p->cmd_list = (struct cmd_header *) pages;
+  p->fis = pages + SLOT_CNT * sizeof *p->cmd_list;
+  p->tables = (struct cmd_table *) (pages + PGSIZE);
+  for (i = 0; i < SLOT_CNT; i++)
+    p->cmd_list[i].ctba = vtop (&p->tables[i]);
+
+  port_reg (p, PORT_CLB) = vtop (p->cmd_list);
+  port_reg (p, PORT_CLBU) = 0;
+  port_reg (p, PORT_FB) = vtop (p->fis);
+  port_reg (p, PORT_FBU) = 0;
+  port_reg (p, PORT_SERR) = 0xffffffff;
+  port_reg (p, PORT_IS) = 0xffffffff;
+  port_reg (p, PORT_IE) = 0;
+  port_reg (p, PORT_CMD) |= PORT_CMD_FRE;
+  for (i = 0; port_reg (p, PORT_TFD) & (STA_BSY | STA_DRQ); i++)
+    {
+      if (i >= 1000)
+        {
+          printf ("%s: disk stays busy\n", p->name);
+          goto fail;
+        }
+      timer_msleep (1);
+    }
+  port_reg (p, PORT_CMD) |= PORT_CMD_ST;
+
+  p->busy = p->issued = 0;
+  p->ncq = false;
+  p->slot_cnt = 1;
+  if (!identify_device (p))
+    goto fail;
+  if (p->ncq && (cap & CAP_SNCQ))
+    {
+      if (p->slot_cnt > CAP_NCS (cap))
+        p->slot_cnt = CAP_NCS (cap);
+    }
+  else
+    {
+      p->ncq = false;
+      p->slot_cnt = 1;
+    }
+  sema_init (&p->free_slots, p->slot_cnt);
+  if (p->ncq)
+    snprintf (p->extra_info + strlen (p->extra_info),
+              sizeof p->extra_info - strlen (p->extra_info),
+              ", NCQ depth %zu", p->slot_cnt);
+
+  port_reg (p, PORT_IE) = PORT_IS_DHRS | PORT_IS_SDBS | PORT_IS_TFES;
+  return true;
+
+ fail:
+  stop_port (p);
+  palloc_free_multiple (pages, PORT_PAGES);
+  return false;
+}
+
+/* Stops port P from processing commands and receiving FISes.
+   Returns true if successful, false if it keeps running. */
+static bool
+stop_port (struct ahci_port *p)
+{
+  int i;
+
+  port_reg (p, PORT_CMD) &= ~(PORT_CMD_ST | PORT_CMD_FRE);
+  for (i = 0; i < 500; i++)
+    {
+      if (!(port_reg (p, PORT_CMD) & (PORT_CMD_CR | PORT_CMD_FR)))
+        return true;
+      timer_msleep (1);
+    }
+  return false;
+}
+
+/* Sends an IDENTIFY DEVICE command to port P's disk, polling for
+   the result, and records its capacity, its NCQ queue depth, and
+   its model and serial number.  Returns true if the disk can be
+   used, false otherwise. */
+static bool
+identify_device (struct ahci_port *p)
+{
+  static uint16_t id[BLOCK_SECTOR_SIZE / 2];
+  uint64_t capacity;
+  char *model, *serial;
+  int i;
+
+  fill_command (p, 0, CMD_IDENTIFY_DEVICE, 0, 0, id, sizeof id, false);
+  port_reg (p, PORT_CI) = 1;
+  for (i = 0; port_reg (p, PORT_CI) & 1; i++)
+    {
+      if (i >= 1000 || (port_reg (p, PORT_IS) & PORT_IS_TFES))
+        {
+          printf ("%s: IDENTIFY DEVICE failed\n", p->name);
+          return false;
+        }
+      timer_msleep (1);
+    }
+  port_reg (p, PORT_IS) = 0xffffffff;
+
+  /* Transfers use the 48-bit commands (word 83, bit 10), which
+     also give the capacity (words 100-103). */
+  if (!(id[83] & 0x0400))
+    {
+      printf ("%s: ignoring disk without 48-bit addressing\n", p->name);
+      return false;
+    }
+  capacity = (id[100] | ((uint64_t) id[101] << 16)
+              | ((uint64_t) id[102] << 32) | ((uint64_t) id[103] << 48));
+
+  /* Disable access to disks over 1 GB, which are likely physical
+     disks rather than virtual ones, as ide.c does. */
+  if (capacity >= 1024 * 1024 * 1024 / BLOCK_SECTOR_SIZE)
+    {
+      printf ("%s: ignoring ", p->name);
+      print_human_readable_size (capacity * BLOCK_SECTOR_SIZE);
+      printf ("disk for safety\n");
+      return false;
+    }
+  p->capacity = capacity;
+
+  /* NCQ support (word 76, bit 8) and queue depth (word 75). */
+  if (id[76] & 0x0100)
+    {
+      p->ncq = true;
+      p->slot_cnt = (id[75] & 0x1f) + 1;
+    }
+
+  model = descramble_ata_string ((char *) &id[10], 20);
+  serial = descramble_ata_string ((char *) &id[27], 40);
+  snprintf (p->extra_info, sizeof p->extra_info,
+            "model \"%s\", serial \"%s\"", model, serial);
+  return true;
+}
+
+/* Translates STRING, which consists of SIZE bytes in a funky
+   format, into a null-terminated string in-place.  Drops
+   trailing whitespace and null bytes.  Returns STRING.  */
+static char *
+descramble_ata_string (char *string, int size)
+{
+  int i;
+
+  /* Swap all pairs of bytes. */
+  for (i = 0; i + 1 < size; i += 2)
+    {
+      char tmp = string[i];
+      string[i] = string[i + 1];
+      string[i + 1] = tmp;
+    }
+
+  /* Find the last non-white, non-null character. */
+  for (size--; size > 0; size--)
+    {
+      int c = string[size - 1];
+      if (c != '\0' && !isspace (c))
+        break;
+    }
+  string[size] = '\0';
+
+  return string;
+}
+
+/* Prepares command slot SLOT of port P to send COMMAND for the CNT
+   sectors starting at SEC_NO, moving SIZE bytes between the device
+   and BUFFER in the direction given by WRITE.  The queued commands
+   carry the count in the features register and the slot in the
+   count register. */
+static void
+fill_command (struct ahci_port *p, size_t slot, uint8_t command,
+              block_sector_t sec_no, size_t cnt, void *buffer, size_t size,
+              bool write)
+{
+  struct cmd_header *h = &p->cmd_list[slot];
+  struct cmd_table *t = &p->tables[slot];
+  uint8_t *fis = t->cfis;
+  bool queued = (command == CMD_READ_FPDMA_QUEUED
+                 || command == CMD_WRITE_FPDMA_QUEUED);
+  uint16_t features = queued ? cnt : 0;
+  uint16_t count = queued ? slot << 3 : cnt;
+
+  ASSERT (is_kernel_vaddr (buffer));
+  ASSERT (size > 0 && size <= PRD_MAX_BYTES);
+
+  memset (fis, 0, sizeof t->cfis);
+  fis[0] = FIS_TYPE_REG_H2D;
+  fis[1] = 0x80;                        /* Command, not control. */
+  fis[2] = command;
+  fis[3] = features;
+  fis[4] = sec_no;
+  fis[5] = sec_no >> 8;
+  fis[6] = sec_no >> 16;
+  fis[7] = command == CMD_IDENTIFY_DEVICE ? 0 : DEV_LBA;
+  fis[8] = sec_no >> 24;
+  fis[11] = features >> 8;
+  fis[12] = count;
+  fis[13] = count >> 8;
+
+  t->prdt[0].dba = vtop (buffer);
+  t->prdt[0].dbau = 0;
+  t->prdt[0].dbc = size - 1;
+
+  h->flags = 5 | (write ? CMD_H_WRITE : 0);     /* FIS is 5 dwords. */
+  h->prdtl = 1;
+  h->prdbc = 0;
+}
+
+/* Starts REQ on the disk P_, waiting for a free command slot
+   first if all of them are in use.  REQ's done callback is called
+   from the interrupt handler once the disk has finished with it. */
+static void
+ahci_start (void *p_, struct block_request *req)
+{
+  struct ahci_port *p = p_;
+  enum intr_level old_level;
+  uint8_t command;
+  size_t slot;
+
+  sema_down (&p->free_slots);
+  old_level = intr_disable ();
+  slot = __builtin_ctz (~p->busy);
+  ASSERT (slot < p->slot_cnt);
+  p->busy |= 1u << slot;
+  p->reqs[slot] = req;
+  intr_set_level (old_level);
+
+  if (p->ncq)
+    command = req->write ? CMD_WRITE_FPDMA_QUEUED : CMD_READ_FPDMA_QUEUED;
+  else
+    command = req->write ? CMD_WRITE_DMA_EXT : CMD_READ_DMA_EXT;
+  fill_command (p, slot, command, req->sector, req->cnt, req->buffer,
+                req->cnt * BLOCK_SECTOR_SIZE, req->write);
+
+  /* Queued commands must be marked active before they are issued.
+     Until the slot is in ISSUED, the interrupt handler leaves it
+     alone, although SACT and CI do not show it yet. */
+  old_level = intr_disable ();
+  if (p->ncq)
+    port_reg (p, PORT_SACT) = 1u << slot;
+  port_reg (p, PORT_CI) = 1u << slot;
+  p->issued |= 1u << slot;
+  intr_set_level (old_level);
+}
+
+/* Moves CNT sectors starting at SEC_NO between disk P_ and BUFFER,
+   in the direction given by WRITE, and waits for the transfer to
+   finish. */
+static void
+ahci_transfer (void *p_, block_sector_t sec_no, size_t cnt, void *buffer,
+               bool write)
+{
+  struct block_request req;
+  struct semaphore done;
+
+  sema_init (&done, 0);
+  block_request_init (&req, sec_no, cnt, buffer, write,
+                      block_request_wakeup, &done);
+  ahci_start (p_, &req);
+  sema_down (&done);
+}
+
+static void
+ahci_read (void *p_, block_sector_t sec_no, void *buffer)
+{
+  ahci_transfer (p_, sec_no, 1, buffer, false);
+}
+
+static void
+ahci_write (void *p_, block_sector_t sec_no, const void *buffer)
+{
+  ahci_transfer (p_, sec_no, 1, (void *) buffer, true);
+}
+
+static void
+ahci_read_multiple (void *p_, block_sector_t sec_no, size_t cnt,
+                    void *buffer)
+{
+  ahci_transfer (p_, sec_no, cnt, buffer, false);
+}
+
+static void
+ahci_write_multiple (void *p_, block_sector_t sec_no, size_t cnt,
+                     const void *buffer)
+{
+  ahci_transfer (p_, sec_no, cnt, (void *) buffer, true);
+}
+
+static struct block_operations ahci_operations =
+  {
+    ahci_read,
+    ahci_write,
+    ahci_read_multiple,
+    ahci_write_multiple,
+    ahci_start
+  };
+
+/* AHCI interrupt handler.  Completes every command that the disks
+   on the interrupting controllers have finished: queued commands
+   leave SACT when done, the others leave CI. */
+static void
+interrupt_handler (struct intr_frame *f UNUSED)
+{
+  struct ahci_hba *h;
+  struct ahci_port *p;
+
+  for (h = hbas; h < hbas + hba_cnt; h++)
+    {
+      uint32_t pending = hba_reg (h, HBA_IS);
+
+      if (pending == 0)
+        continue;
+      for (p = ports; p < ports + port_cnt; p++)
+        {
+          uint32_t status, done;
+
+          if (p->hba != h || !(pending & (1u << p->port_no)))
+            continue;
+
+          status = port_reg (p, PORT_IS);
+          port_reg (p, PORT_IS) = status;       /* Acknowledge. */
+          if (status & PORT_IS_TFES)
+            PANIC ("%s: command failed, status %02"PRIx32", error %02"PRIx32,
+                   p->name, port_reg (p, PORT_TFD) & 0xff,
+                   (port_reg (p, PORT_TFD) >> 8) & 0xff);
+
+          done = p->issued & ~(port_reg (p, PORT_SACT)
+                               | port_reg (p, PORT_CI));
+          while (done != 0)
+            {
+              size_t slot = __builtin_ctz (done);
+              struct block_request *req = p->reqs[slot];
+
+              done &= ~(1u << slot);
+              p->busy &= ~(1u << slot);
+              p->issued &= ~(1u << slot);
+              sema_up (&p->free_slots);
+              req->done (req, req->aux);
+            }
+        }
+      hba_reg (h, HBA_IS) = pending;
+    }
+}
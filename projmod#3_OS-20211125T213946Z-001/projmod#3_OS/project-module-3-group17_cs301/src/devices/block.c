@@ -3,7 +3,36 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Time a request may wait under the deadline scheduler before it
+   is served ahead of the elevator order. */
+#define READ_EXPIRE_MS 500
+#define WRITE_EXPIRE_MS 5000
+
+/* Most sectors the dispatcher gathers into one transfer. */
+#define MERGE_MAX_SECTORS 32
+
+/* Pending requests of a block device, served by its dispatcher
+   thread. */
+struct block_queue
+  {
+    struct lock lock;                   /* Protects the members below. */
+    struct condition not_empty;         /* Signaled when a request arrives. */
+    struct list sorted;                 /* Requests in sector order. */
+    struct list fifo[2];                /* Reads, writes in arrival order. */
+    unsigned long long seq;             /* Next arrival number. */
+    block_sector_t head;                /* Where the last transfer ended,
+                                           in the direction of travel. */
+    bool ascending;                     /* LOOK direction. */
+    tid_t dispatcher;                   /* TID_ERROR until started. */
+    uint8_t *bounce;                    /* For merged requests whose buffers
+                                           are not adjacent, or null. */
+  };
 
 /* A block device. */
 struct block
@@ -17,10 +46,35 @@ struct block
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
 
+    struct block *parent;               /* Device this is a part of, or null. */
+    block_sector_t start;               /* First sector within PARENT. */
+    struct block_queue queue;           /* Requests, unless PARENT is set. */
+
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
   };
 
+/* An I/O scheduler: picks the next request to dispatch from a
+   non-empty queue, leaving it queued.  Called with the queue
+   locked. */
+struct block_scheduler
+  {
+    const char *name;
+    struct block_request *(*next) (struct block_queue *);
+  };
+
+static struct block_request *fifo_next (struct block_queue *);
+static struct block_request *look_next (struct block_queue *);
+static struct block_request *deadline_next (struct block_queue *);
+
+static const struct block_scheduler schedulers[] =
+  {
+    {"fifo", fifo_next},                /* Arrival order. */
+    {"look", look_next},                /* Elevator. */
+    {"deadline", deadline_next},        /* Elevator, but no starvation. */
+  };
+static const struct block_scheduler *scheduler = &schedulers[2];
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
@@ -28,6 +82,9 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void block_dispatch (void *block_);
+static void block_transfer (struct block *, struct block_request **,
+                            size_t n, size_t cnt);
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -113,6 +170,19 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Verifies that the CNT sectors starting at SECTOR are all within
+   BLOCK.  Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  ASSERT (cnt > 0);
+  check_sector (block, sector);
+  if (cnt - 1 > block->size - 1 - sector)
+    PANIC ("Access past end of device %s (sector=%"PRDSNu", cnt=%zu, "
+           "size=%"PRDSNu")\n", block_name (block), sector, cnt,
+           block->size);
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -120,9 +190,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, 1, buffer);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +201,143 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, 1, buffer);
+}
+
+/* Reads the CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that can move several sectors per command do so;
+   for the others this is the same as CNT calls to block_read().
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffer)
+{
+  struct block_request req;
+  struct semaphore done;
+
+  sema_init (&done, 0);
+  block_request_init (&req, sector, cnt, buffer, false,
+                      block_request_wakeup, &done);
+  block_submit (block, &req);
+  sema_down (&done);
+}
+
+/* Writes the CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving all of
+   the data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      size_t cnt, const void *buffer)
+{
+  struct block_request req;
+  struct semaphore done;
+
+  sema_init (&done, 0);
+  block_request_init (&req, sector, cnt, (void *) buffer, true,
+                      block_request_wakeup, &done);
+  block_submit (block, &req);
+  sema_down (&done);
+}
+
+/* Initializes REQ to move CNT sectors starting at SECTOR between
+   BUFFER and a block device, in the direction given by WRITE, and
+   to call DONE (REQ, AUX) when it is complete. */
+void
+block_request_init (struct block_request *req, block_sector_t sector,
+                    size_t cnt, void *buffer, bool write,
+                    block_done_func *done, void *aux)
+{
+  req->sector = sector;
+  req->cnt = cnt;
+  req->buffer = buffer;
+  req->write = write;
+  req->done = done;
+  req->aux = aux;
+}
+
+/* A block_done_func that ups the semaphore passed as AUX, for
+   waiting on one or several requests. */
+void
+block_request_wakeup (struct block_request *req UNUSED, void *sema)
+{
+  sema_up (sema);
+}
+
+/* Queues REQ on BLOCK and returns without waiting for it.  REQ
+   must stay valid until its callback has been called.  Requests on
+   a partition go to the queue of the whole device, so that the
+   scheduler sees all the traffic that moves the same disk head;
+   REQ's sector is then rewritten relative to that device.  REQ's
+   buffer must be in kernel memory: the transfer runs in the
+   device's dispatcher thread, which has no user mappings. */
+void
+block_submit (struct block *block, struct block_request *req)
+{
+  struct block_queue *q;
+  struct list_elem *e;
+  int expire_ms;
+
+  check_sectors (block, req->sector, req->cnt);
+  ASSERT (is_kernel_vaddr (req->buffer));
+  ASSERT (!req->write || block->type != BLOCK_FOREIGN);
+  for (;;)
+    {
+      if (req->write)
+        block->write_cnt += req->cnt;
+      else
+        block->read_cnt += req->cnt;
+      if (block->parent == NULL)
+        break;
+      req->sector += block->start;
+      block = block->parent;
+    }
+
+  q = &block->queue;
+  expire_ms = req->write ? WRITE_EXPIRE_MS : READ_EXPIRE_MS;
+  lock_acquire (&q->lock);
+  ASSERT (q->dispatcher != thread_tid ());
+  req->seq = q->seq++;
+  req->deadline = timer_ticks () + expire_ms * TIMER_FREQ / 1000;
+  for (e = list_begin (&q->sorted); e != list_end (&q->sorted);
+       e = list_next (e))
+    if (list_entry (e, struct block_request, sort_elem)->sector > req->sector)
+      break;
+  list_insert (e, &req->sort_elem);
+  list_push_back (&q->fifo[req->write], &req->fifo_elem);
+
+  if (q->dispatcher == TID_ERROR)
+    {
+      char name[sizeof block->name + 4];
+
+      q->bounce = malloc (MERGE_MAX_SECTORS * BLOCK_SECTOR_SIZE);
+      snprintf (name, sizeof name, "blk-%s", block->name);
+      q->dispatcher = thread_create (name, PRI_MAX, block_dispatch, block);
+      if (q->dispatcher == TID_ERROR)
+        PANIC ("%s: cannot start dispatcher thread", block->name);
+    }
+  cond_signal (&q->not_empty, &q->lock);
+  lock_release (&q->lock);
+}
+
+/* Selects the I/O scheduler used by all block devices.  Returns
+   false if NAME is not one of "fifo", "look" or "deadline". */
+bool
+block_set_scheduler (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof schedulers / sizeof *schedulers; i++)
+    if (name != NULL && !strcmp (name, schedulers[i].name))
+      {
+        scheduler = &schedulers[i];
+        return true;
+      }
+  return false;
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -198,9 +399,22 @@ block_register (const char *name, enum block_type type,
   block->size = size;
   block->ops = ops;
   block->aux = aux;
+  block->parent = NULL;
+  block->start = 0;
   block->read_cnt = 0;
   block->write_cnt = 0;
 
+  lock_init (&block->queue.lock);
+  cond_init (&block->queue.not_empty);
+  list_init (&block->queue.sorted);
+  list_init (&block->queue.fifo[0]);
+  list_init (&block->queue.fifo[1]);
+  block->queue.seq = 0;
+  block->queue.head = 0;
+  block->queue.ascending = true;
+  block->queue.dispatcher = TID_ERROR;
+  block->queue.bounce = NULL;
+
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
   printf (")");
@@ -211,6 +425,198 @@ block_register (const char *name, enum block_type type,
   return block;
 }
 
+/* Declares BLOCK to be the sectors of PARENT from START on, so
+   that requests on BLOCK are queued and scheduled together with
+   the rest of PARENT's. */
+void
+block_set_parent (struct block *block, struct block *parent,
+                  block_sector_t start)
+{
+  ASSERT (start + block->size <= parent->size);
+  block->parent = parent;
+  block->start = start;
+}
+
+/* Dispatcher thread of the block device passed as BLOCK_.  Takes
+   the request the scheduler picks, together with the queued
+   requests in the same direction for the sectors right after it,
+   and has the driver move them all in one transfer.  Drivers that
+   can start requests asynchronously get them one at a time
+   instead, as fast as they accept them. */
+static void
+block_dispatch (void *block_)
+{
+  struct block *block = block_;
+  struct block_queue *q = &block->queue;
+  struct block_request *batch[MERGE_MAX_SECTORS];
+
+  for (;;)
+    {
+      struct block_request *req;
+      struct list_elem *e;
+      size_t n = 0, cnt, i;
+
+      lock_acquire (&q->lock);
+      while (list_empty (&q->sorted))
+        cond_wait (&q->not_empty, &q->lock);
+
+      req = scheduler->next (q);
+      if (block->ops->start != NULL)
+        { /* The device keeps several in flight and orders them itself. */
+          list_remove (&req->sort_elem);
+          list_remove (&req->fifo_elem);
+          q->head = q->ascending ? req->sector + req->cnt : req->sector;
+          lock_release (&q->lock);
+          block->ops->start (block->aux, req);
+          continue;
+        }
+
+      batch[n++] = req;
+      cnt = req->cnt;
+      for (e = list_next (&req->sort_elem); e != list_end (&q->sorted);
+           e = list_next (e))
+        {
+          struct block_request *next = list_entry (e, struct block_request,
+                                                   sort_elem);
+          struct block_request *last = batch[n - 1];
+          bool adjacent = ((uint8_t *) last->buffer
+                           + last->cnt * BLOCK_SECTOR_SIZE == next->buffer);
+
+          if (next->write != req->write
+              || next->sector != req->sector + cnt
+              || cnt + next->cnt > MERGE_MAX_SECTORS
+              || (!adjacent && q->bounce == NULL))
+            break;
+          batch[n++] = next;
+          cnt += next->cnt;
+        }
+
+      for (i = 0; i < n; i++)
+        {
+          list_remove (&batch[i]->sort_elem);
+          list_remove (&batch[i]->fifo_elem);
+        }
+      q->head = q->ascending ? req->sector + cnt : req->sector;
+      lock_release (&q->lock);
+
+      block_transfer (block, batch, n, cnt);
+      for (i = 0; i < n; i++)
+        batch[i]->done (batch[i], batch[i]->aux);
+    }
+}
+
+/* Has BLOCK's driver move the CNT sectors of the N requests in
+   BATCH, which are for consecutive sectors in the same direction.
+   If their buffers do not follow each other in memory, the data
+   goes through the queue's bounce buffer. */
+static void
+block_transfer (struct block *block, struct block_request **batch,
+                size_t n, size_t cnt)
+{
+  struct block_request *req = batch[0];
+  uint8_t *buffer = req->buffer;
+  size_t i, ofs;
+
+  for (i = 1; i < n; i++)
+    if ((uint8_t *) batch[i - 1]->buffer + batch[i - 1]->cnt * BLOCK_SECTOR_SIZE
+        != batch[i]->buffer)
+      buffer = block->queue.bounce;
+
+  if (buffer != req->buffer && req->write)
+    for (i = 0, ofs = 0; i < n; ofs += batch[i++]->cnt * BLOCK_SECTOR_SIZE)
+      memcpy (buffer + ofs, batch[i]->buffer, batch[i]->cnt * BLOCK_SECTOR_SIZE);
+
+  if (req->write && block->ops->write_multiple != NULL)
+    block->ops->write_multiple (block->aux, req->sector, cnt, buffer);
+  else if (!req->write && block->ops->read_multiple != NULL)
+    block->ops->read_multiple (block->aux, req->sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      if (req->write)
+        block->ops->write (block->aux, req->sector + i,
+                           buffer + i * BLOCK_SECTOR_SIZE);
+      else
+        block->ops->read (block->aux, req->sector + i,
+                          buffer + i * BLOCK_SECTOR_SIZE);
+
+  if (buffer != req->buffer && !req->write)
+    for (i = 0, ofs = 0; i < n; ofs += batch[i++]->cnt * BLOCK_SECTOR_SIZE)
+      memcpy (batch[i]->buffer, buffer + ofs, batch[i]->cnt * BLOCK_SECTOR_SIZE);
+}
+
+/* FIFO scheduler: the oldest request, read or write. */
+static struct block_request *
+fifo_next (struct block_queue *q)
+{
+  struct block_request *r = NULL, *w = NULL;
+
+  if (!list_empty (&q->fifo[0]))
+    r = list_entry (list_front (&q->fifo[0]), struct block_request, fifo_elem);
+  if (!list_empty (&q->fifo[1]))
+    w = list_entry (list_front (&q->fifo[1]), struct block_request, fifo_elem);
+  if (r == NULL || (w != NULL && w->seq < r->seq))
+    return w;
+  return r;
+}
+
+/* LOOK elevator: the nearest request in the direction the head is
+   moving, turning around when there are no more that way. */
+static struct block_request *
+look_next (struct block_queue *q)
+{
+  struct list_elem *e;
+
+  if (q->ascending)
+    {
+      for (e = list_begin (&q->sorted); e != list_end (&q->sorted);
+           e = list_next (e))
+        {
+          struct block_request *req = list_entry (e, struct block_request,
+                                                  sort_elem);
+          if (req->sector >= q->head)
+            return req;
+        }
+      q->ascending = false;
+      return list_entry (list_back (&q->sorted), struct block_request,
+                         sort_elem);
+    }
+  else
+    {
+      for (e = list_rbegin (&q->sorted); e != list_rend (&q->sorted);
+           e = list_prev (e))
+        {
+          struct block_request *req = list_entry (e, struct block_request,
+                                                  sort_elem);
+          if (req->sector < q->head)
+            return req;
+        }
+      q->ascending = true;
+      return list_entry (list_front (&q->sorted), struct block_request,
+                         sort_elem);
+    }
+}
+
+/* Deadline scheduler: LOOK, except that a request whose deadline
+   has passed is served first, reads before writes.  Reads expire
+   sooner, since a thread is usually waiting for them. */
+static struct block_request *
+deadline_next (struct block_queue *q)
+{
+  int64_t now = timer_ticks ();
+  int i;
+
+  for (i = 0; i < 2; i++)
+    if (!list_empty (&q->fifo[i]))
+      {
+        struct block_request *req = list_entry (list_front (&q->fifo[i]),
+                                                struct block_request,
+                                                fifo_elem);
+        if (req->deadline <= now)
+          return req;
+      }
+  return look_next (q);
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <list.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,9 +55,51 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt, void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests.
+
+   A request moves CNT sectors starting at SECTOR between BUFFER
+   and a block device.  block_submit() queues it and returns at
+   once.  The device's dispatcher thread later passes it to the
+   driver, in the order chosen by the I/O scheduler and possibly
+   in the same transfer as requests for the sectors right after
+   it, and then calls DONE (REQUEST, AUX).  DONE runs in the
+   dispatcher thread or, for drivers with a start operation, in
+   the driver's interrupt handler, so it must not sleep. */
+struct block_request;
+typedef void block_done_func (struct block_request *, void *aux);
+
+struct block_request
+  {
+    /* Set by block_request_init(). */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                         /* Direction. */
+    block_done_func *done;              /* Completion callback. */
+    void *aux;                          /* Passed to DONE. */
+
+    /* Owned by the block layer while the request is queued. */
+    struct list_elem sort_elem;         /* Element in queue, by sector. */
+    struct list_elem fifo_elem;         /* Element in queue, by arrival. */
+    unsigned long long seq;             /* Arrival number. */
+    int64_t deadline;                   /* Timer tick to serve it by. */
+  };
+
+void block_request_init (struct block_request *, block_sector_t, size_t cnt,
+                         void *buffer, bool write,
+                         block_done_func *, void *aux);
+void block_submit (struct block *, struct block_request *);
+block_done_func block_request_wakeup;
+
+/* I/O scheduler, "fifo", "look" or "deadline". */
+bool block_set_scheduler (const char *name);
+
 /* Statistics. */
 void block_print_stats (void);
 
@@ -63,12 +107,30 @@ void block_print_stats (void);
 
 struct block_operations
   {
+    /* Required, except for a device given a parent with
+       block_set_parent(), whose requests never reach its own
+       operations. */
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional: transfer CNT consecutive sectors at once.  If
+       null, the block layer falls back to one call per sector. */
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+
+    /* Optional: start REQ and return without waiting for it, so
+       that the device can work on several requests at once.  The
+       driver calls REQ's done callback when it completes.  May
+       sleep until the device has room for another request. */
+    void (*start) (void *aux, struct block_request *req);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_set_parent (struct block *, struct block *parent,
+                       block_sector_t start);
 
 #endif /* devices/block.h */
@@ -3,15 +3,22 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].  When the
+   controller is a PCI IDE controller capable of bus mastering,
+   such as the PIIX emulated by QEMU, transfers to and from kernel
+   memory use bus-master DMA as described in [SFF-8038i];
+   otherwise they fall back to PIO. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -30,10 +37,25 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus-master IDE port addresses, relative to the channel's share
+   of the controller's BAR4. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table address. */
+
+/* Bus-master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer direction: device to memory. */
+
+/* Bus-master Status Register bits. */
+#define BM_ST_ERR 0x02          /* Error (write 1 to clear). */
+#define BM_ST_INTR 0x04         /* Interrupt (write 1 to clear). */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +71,37 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors one command can move: a sector count of 0 in the
+   Sector Count register means 256. */
+#define MAX_SECTORS_PER_CMD 256
+
+/* PCI class and programming interface bits of IDE controllers. */
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_IDE_NATIVE 0x05      /* Either channel in native PCI mode. */
+#define PCI_IDE_BUS_MASTER 0x80  /* Bus-master capable. */
+
+/* Physical Region Descriptor: one physically contiguous piece of
+   a DMA transfer.  A region may not cross a 64 kB boundary, and a
+   size of 0 means 64 kB. */
+struct prd
+  {
+    uint32_t addr;              /* Physical base address. */
+    uint16_t size;              /* Byte count. */
+    uint16_t flags;             /* PRD_EOT on the last entry. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_BOUNDARY 0x10000    /* Regions may not cross this. */
+
+/* A transfer of MAX_SECTORS_PER_CMD sectors spans at most this many
+   64 kB regions. */
+#define PRD_CNT 4
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +110,9 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt for READ/WRITE
+                                   MULTIPLE, 0 if not enabled. */
+    bool dma;                   /* Use bus-master DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -72,6 +128,13 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus-master I/O base, 0 if none. */
+
+    /* PRD table, aligned to its own size so that it never crosses a
+       64 kB boundary. */
+    struct prd prd[PRD_CNT] __attribute__ ((aligned (sizeof (struct prd)
+                                                     * PRD_CNT)));
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -85,10 +148,22 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void ide_read_multiple (void *, block_sector_t, size_t cnt, void *);
+static void ide_write_multiple (void *, block_sector_t, size_t cnt,
+                                const void *);
+static uint16_t find_bus_master (void);
+static void pio_read (struct ata_disk *, block_sector_t, size_t cnt,
+                      void *);
+static void pio_write (struct ata_disk *, block_sector_t, size_t cnt,
+                       const void *);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          void *, bool write);
+static void set_multiple_mode (struct ata_disk *, uint8_t cnt);
+static void select_sectors (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
-static void input_sector (struct channel *, void *);
-static void output_sector (struct channel *, const void *);
+static size_t drq_block_sectors (const struct ata_disk *, size_t left);
+static void input_sectors (struct channel *, void *, size_t cnt);
+static void output_sectors (struct channel *, const void *, size_t cnt);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -102,6 +177,7 @@ void
 ide_init (void) 
 {
   size_t chan_no;
+  uint16_t bm_base = find_bus_master ();
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
@@ -126,6 +202,7 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +213,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -279,7 +358,7 @@ identify_ata_device (struct ata_disk *d)
       d->is_ata = false;
       return;
     }
-  input_sector (c, id);
+  input_sectors (c, id, 1);
 
   /* Calculate capacity.
      Read model name and serial number. */
@@ -303,6 +382,18 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Let multi-sector transfers interrupt once per block of sectors
+     rather than once per sector, with the largest block the disk
+     supports (word 47). */
+  if ((uint8_t) id[47 * 2] > 1)
+    set_multiple_mode (d, (uint8_t) id[47 * 2]);
+
+  /* Use DMA if the controller can be bus master and the disk
+     supports it (word 49, bit 8). */
+  d->dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x0100) != 0;
+  if (d->dma)
+    strlcat (extra_info, ", DMA", sizeof extra_info);
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
@@ -344,16 +435,7 @@ descramble_ata_string (char *string, int size)
 static void
 ide_read (void *d_, block_sector_t sec_no, void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  ide_read_multiple (d_, sec_no, 1, buffer);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -363,37 +445,250 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
    per-disk locking is unneeded. */
 static void
 ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d_, sec_no, 1, buffer);
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
+   Each command moves up to MAX_SECTORS_PER_CMD sectors.  BUFFER
+   is filled by DMA when D supports it, with a single interrupt per
+   command, and through PIO otherwise.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t cmd_cnt = cnt < MAX_SECTORS_PER_CMD ? cnt : MAX_SECTORS_PER_CMD;
+
+      if (!d->dma || !dma_transfer (d, sec_no, cmd_cnt, buffer, false))
+        pio_read (d, sec_no, cmd_cnt, buffer);
+      buffer += cmd_cnt * BLOCK_SECTOR_SIZE;
+      sec_no += cmd_cnt;
+      cnt -= cmd_cnt;
+    }
   lock_release (&c->lock);
 }
 
+/* Writes the CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns after
+   the disk has acknowledged receiving all of the data.  Commands
+   are split, and DMA or PIO chosen, as in ide_read_multiple().
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffer_)
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+
+  lock_acquire (&c->lock);
+  while (cnt > 0)
+    {
+      size_t cmd_cnt = cnt < MAX_SECTORS_PER_CMD ? cnt : MAX_SECTORS_PER_CMD;
+
+      if (!d->dma
+          || !dma_transfer (d, sec_no, cmd_cnt, (void *) buffer, true))
+        pio_write (d, sec_no, cmd_cnt, buffer);
+      buffer += cmd_cnt * BLOCK_SECTOR_SIZE;
+      sec_no += cmd_cnt;
+      cnt -= cmd_cnt;
+    }
+  lock_release (&c->lock);
+}
+
+/* Reads CNT sectors, at most MAX_SECTORS_PER_CMD, starting at
+   SEC_NO from disk D into BUFFER in PIO mode.  With READ MULTIPLE
+   the disk interrupts once per block of D->multiple sectors,
+   otherwise once per sector.  Call with D's channel locked. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          void *buffer_)
+{
+  struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+  size_t done = 0;
+
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0 && cnt > 1
+                         ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY));
+  while (done < cnt)
+    {
+      size_t blk_cnt = drq_block_sectors (d, cnt - done);
+
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      input_sectors (c, buffer, blk_cnt);
+      buffer += blk_cnt * BLOCK_SECTOR_SIZE;
+      done += blk_cnt;
+    }
+}
+
+/* Writes CNT sectors, at most MAX_SECTORS_PER_CMD, starting at
+   SEC_NO to disk D from BUFFER in PIO mode, as pio_read().  Call
+   with D's channel locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const void *buffer_)
+{
+  struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+  size_t done = 0;
+
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0 && cnt > 1
+                         ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY));
+  while (done < cnt)
+    {
+      size_t blk_cnt = drq_block_sectors (d, cnt - done);
+
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      output_sectors (c, buffer, blk_cnt);
+      sema_down (&c->completion_wait);
+      buffer += blk_cnt * BLOCK_SECTOR_SIZE;
+      done += blk_cnt;
+    }
+}
+
+/* Moves CNT sectors, at most MAX_SECTORS_PER_CMD, starting at
+   SEC_NO between disk D and BUFFER by bus-master DMA: the
+   controller copies the data itself and interrupts once at the
+   end.  BUFFER must be a kernel virtual address, so that it is
+   physically contiguous.  WRITE gives the direction.
+   Returns false if the transfer failed, after turning DMA off for
+   D so that the caller and later requests use PIO.  Call with D's
+   channel locked. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool write)
+{
+  struct channel *c = d->channel;
+  uintptr_t phys = vtop (buffer);
+  size_t left = cnt * BLOCK_SECTOR_SIZE;
+  uint8_t direction = write ? 0 : BM_CMD_READ;
+  uint8_t bm_status, status;
+  struct prd *prd;
+
+  /* Describe BUFFER, splitting it at 64 kB boundaries. */
+  for (prd = c->prd; ; prd++)
+    {
+      size_t size = PRD_BOUNDARY - phys % PRD_BOUNDARY;
+      if (size > left)
+        size = left;
+
+      ASSERT (prd < c->prd + PRD_CNT);
+      prd->addr = phys;
+      prd->size = size % PRD_BOUNDARY;
+      prd->flags = size == left ? PRD_EOT : 0;
+      phys += size;
+      left -= size;
+      if (left == 0)
+        break;
+    }
+
+  /* Program the controller, issue the command, then start the
+     engine, in the order [SFF-8038i] asks for. */
+  select_sectors (d, sec_no, cnt);
+  outl (reg_bm_prdt (c), vtop (c->prd));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BM_ST_ERR | BM_ST_INTR);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), direction | BM_CMD_START);
+  sema_down (&c->completion_wait);
+
+  /* Stop the engine and acknowledge. */
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c), bm_status | BM_ST_ERR | BM_ST_INTR);
+  status = inb (reg_alt_status (c));
+  if ((bm_status & BM_ST_ERR) != 0 || (status & (STA_BSY | STA_ERR)) != 0)
+    {
+      printf ("%s: DMA failed, sector=%"PRDSNu", using PIO\n",
+              d->name, sec_no);
+      d->dma = false;
+      return false;
+    }
+  return true;
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple,
+    NULL
   };
 
+/* Sets the number of sectors that disk D moves per interrupt under
+   READ/WRITE MULTIPLE to CNT, which must be a block size the disk
+   supports.  Leaves D->multiple at 0 if the disk refuses. */
+static void
+set_multiple_mode (struct ata_disk *d, uint8_t cnt)
+{
+  struct channel *c = d->channel;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+    d->multiple = cnt;
+}
+
+/* Looks for a PCI IDE controller that runs both channels at the
+   legacy ports we drive and can be bus master.  If there is one,
+   enables bus mastering on it and returns the I/O base of its
+   bus-master registers; otherwise returns 0. */
+static uint16_t
+find_bus_master (void)
+{
+  struct pci_device *pd = NULL;
+
+  while ((pd = pci_find_class (PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, pd))
+         != NULL)
+    {
+      uint16_t base = PCI_BAR_IO (pd->bar[4]);
+
+      if ((pd->prog_if & PCI_IDE_BUS_MASTER) == 0
+          || (pd->prog_if & PCI_IDE_NATIVE) != 0
+          || base == 0)
+        continue;
+      pci_enable (pd, PCI_CMD_IO | PCI_CMD_MASTER);
+      return base;
+    }
+  return 0;
+}
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT, at most
+   MAX_SECTORS_PER_CMD, to the disk's sector selection registers.
+   (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sectors (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_CMD);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_SECTORS_PER_CMD);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -414,20 +709,29 @@ issue_pio_command (struct channel *c, uint8_t command)
   outb (reg_command (c), command);
 }
 
-/* Reads a sector from channel C's data register in PIO mode into
-   SECTOR, which must have room for BLOCK_SECTOR_SIZE bytes. */
+/* Returns how many of the LEFT sectors still to move in the
+   current command disk D transfers before its next interrupt. */
+static size_t
+drq_block_sectors (const struct ata_disk *d, size_t left)
+{
+  size_t blk_cnt = d->multiple > 0 ? (size_t) d->multiple : 1;
+  return blk_cnt < left ? blk_cnt : left;
+}
+
+/* Reads CNT sectors from channel C's data register in PIO mode into
+   SECTORS, which must have room for CNT * BLOCK_SECTOR_SIZE bytes. */
 static void
-input_sector (struct channel *c, void *sector) 
+input_sectors (struct channel *c, void *sectors, size_t cnt) 
 {
-  insw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  insw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
-/* Writes SECTOR to channel C's data register in PIO mode.
-   SECTOR must contain BLOCK_SECTOR_SIZE bytes. */
+/* Writes CNT sectors to channel C's data register in PIO mode.
+   SECTORS must contain CNT * BLOCK_SECTOR_SIZE bytes. */
 static void
-output_sector (struct channel *c, const void *sector) 
+output_sectors (struct channel *c, const void *sectors, size_t cnt) 
 {
-  outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  outsw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
 /* Low-level ATA primitives. */
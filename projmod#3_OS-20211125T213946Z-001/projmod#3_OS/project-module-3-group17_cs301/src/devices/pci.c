@@ -0,0 +1,242 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include <round.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "threads/init.h"
+#include "threads/io.h"
+#include "threads/loader.h"
+#include "threads/palloc.h"
+#include "threads/pte.h"
+#include "threads/vaddr.h"
+
+/* The code in this file enumerates the functions on the PCI buses
+   through configuration mechanism #1 (ports 0xcf8 and 0xcfc) and
+   gives drivers access to their configuration space, to device
+   memory, and to shared interrupt lines.  It does not assign
+   resources: it relies on the BIOS to have done that. */
+
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* Most functions remembered.  QEMU machines have a handful. */
+#define PCI_MAX_DEVICES 32
+
+static struct pci_device devices[PCI_MAX_DEVICES];
+static size_t device_cnt;
+
+/* Interrupt handlers.  PCI functions share interrupt lines, so
+   each line's vector runs all of the handlers registered for it. */
+#define PCI_MAX_HANDLERS 8
+
+struct pci_handler
+  {
+    uint8_t vec_no;             /* Interrupt vector. */
+    intr_handler_func *func;    /* Handler. */
+  };
+
+static struct pci_handler handlers[PCI_MAX_HANDLERS];
+static size_t handler_cnt;
+
+/* Device memory is mapped into the last 4 MB of virtual memory,
+   which one page table covers, in the order it is asked for. */
+#define MMIO_BASE ((uint8_t *) 0xffc00000)
+#define MMIO_PAGES 1024
+#define PTE_PWT 0x8             /* Write-through. */
+#define PTE_PCD 0x10            /* Caching disabled. */
+
+static uint32_t *mmio_pt;
+static size_t mmio_used;
+
+static uint32_t read_config (int bus, int dev, int func, int reg);
+static void probe_function (int bus, int dev, int func);
+static void interrupt_handler (struct intr_frame *);
+
+/* Scans every bus for functions and records them. */
+void
+pci_init (void) 
+{
+  int bus, dev, func;
+
+  for (bus = 0; bus < 256; bus++)
+    for (dev = 0; dev < 32; dev++)
+      {
+        if ((read_config (bus, dev, 0, PCI_REG_ID) & 0xffff) == 0xffff)
+          continue;
+        probe_function (bus, dev, 0);
+
+        /* Bit 7 of the header type says whether there are more. */
+        if (read_config (bus, dev, 0, PCI_REG_HEADER) & 0x00800000)
+          for (func = 1; func < 8; func++)
+            if ((read_config (bus, dev, func, PCI_REG_ID) & 0xffff) != 0xffff)
+              probe_function (bus, dev, func);
+      }
+  printf ("pci: %zu functions found\n", device_cnt);
+}
+
+/* Returns the first function after AFTER, or the first one if
+   AFTER is null, with the given VENDOR_ID and DEVICE_ID.  Returns a
+   null pointer if there are no more. */
+struct pci_device *
+pci_find (uint16_t vendor_id, uint16_t device_id, struct pci_device *after)
+{
+  struct pci_device *d;
+
+  for (d = after != NULL ? after + 1 : devices; d < devices + device_cnt; d++)
+    if (d->vendor_id == vendor_id && d->device_id == device_id)
+      return d;
+  return NULL;
+}
+
+/* Returns the first function after AFTER, or the first one if
+   AFTER is null, of the given CLASS and SUBCLASS.  Returns a null
+   pointer if there are no more. */
+struct pci_device *
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_device *after)
+{
+  struct pci_device *d;
+
+  for (d = after != NULL ? after + 1 : devices; d < devices + device_cnt; d++)
+    if (d->class == class && d->subclass == subclass)
+      return d;
+  return NULL;
+}
+
+/* Returns the 32-bit configuration register REG of D. */
+uint32_t
+pci_read_config (const struct pci_device *d, int reg)
+{
+  return read_config (d->bus, d->dev, d->func, reg);
+}
+
+/* Sets the 16-bit configuration register REG of D to VALUE. */
+void
+pci_write_config16 (const struct pci_device *d, int reg, uint16_t value)
+{
+  outl (PCI_CONFIG_ADDR, (0x80000000 | (d->bus << 16) | (d->dev << 11)
+                          | (d->func << 8) | (reg & 0xfc)));
+  outw (PCI_CONFIG_DATA + (reg & 2), value);
+}
+
+/* Sets COMMAND_BITS, a combination of PCI_CMD_*, in D's command
+   register. */
+void
+pci_enable (const struct pci_device *d, uint16_t command_bits)
+{
+  uint16_t command = pci_read_config (d, PCI_REG_COMMAND);
+  pci_write_config16 (d, PCI_REG_COMMAND, command | command_bits);
+}
+
+/* Has HANDLER called, with NAME for debugging purposes, for
+   interrupts on D's interrupt line.  Registering the same handler
+   for another function on the same line has no further effect, so
+   a driver's handler must check all of the devices it drives. */
+void
+pci_register_handler (const struct pci_device *d, intr_handler_func *handler,
+                      const char *name)
+{
+  uint8_t vec_no = d->irq + 0x20;
+  bool line_used = false;
+  size_t i;
+
+  ASSERT (d->irq < 16);
+  for (i = 0; i < handler_cnt; i++)
+    if (handlers[i].vec_no == vec_no)
+      {
+        if (handlers[i].func == handler)
+          return;
+        line_used = true;
+      }
+
+  if (handler_cnt >= PCI_MAX_HANDLERS)
+    PANIC ("pci: too many interrupt handlers");
+  handlers[handler_cnt].vec_no = vec_no;
+  handlers[handler_cnt].func = handler;
+  handler_cnt++;
+  if (!line_used)
+    intr_register_ext (vec_no, interrupt_handler, name);
+}
+
+/* Maps the SIZE bytes of device memory at physical address PADDR
+   into kernel virtual memory, uncached, and returns their virtual
+   address.  Must be called at boot, before any process exists,
+   because process page directories copy the kernel's when they
+   are created. */
+volatile void *
+pci_map_mem (uint32_t paddr, size_t size)
+{
+  uint32_t first = paddr & ~PGMASK;
+  size_t page_cnt = DIV_ROUND_UP (pg_ofs ((void *) paddr) + size, PGSIZE);
+  uint8_t *vaddr;
+  size_t i;
+
+  ASSERT ((uint8_t *) ptov (init_ram_pages * PGSIZE) <= MMIO_BASE);
+  if (mmio_used + page_cnt > MMIO_PAGES)
+    PANIC ("pci: out of space to map device memory");
+  if (mmio_pt == NULL)
+    {
+      mmio_pt = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+      init_page_dir[pd_no (MMIO_BASE)] = pde_create (mmio_pt);
+    }
+
+  vaddr = MMIO_BASE + mmio_used * PGSIZE;
+  for (i = 0; i < page_cnt; i++)
+    mmio_pt[mmio_used + i] = (first + i * PGSIZE) | PTE_P | PTE_W
+                             | PTE_PWT | PTE_PCD;
+  mmio_used += page_cnt;
+  return vaddr + pg_ofs ((void *) paddr);
+}
+
+/* Runs the handlers registered for the interrupt in F. */
+static void
+interrupt_handler (struct intr_frame *f)
+{
+  size_t i;
+
+  for (i = 0; i < handler_cnt; i++)
+    if (handlers[i].vec_no == f->vec_no)
+      handlers[i].func (f);
+}
+
+/* Returns the 32-bit register REG of function BUS:DEV.FUNC. */
+static uint32_t
+read_config (int bus, int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDR, (0x80000000 | (bus << 16) | (dev << 11)
+                          | (func << 8) | (reg & 0xfc)));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Records function BUS:DEV.FUNC. */
+static void
+probe_function (int bus, int dev, int func)
+{
+  struct pci_device *d;
+  uint32_t id, class;
+  int i;
+
+  if (device_cnt >= PCI_MAX_DEVICES)
+    {
+      printf ("pci: ignoring %02x:%02x.%d, too many functions\n",
+              bus, dev, func);
+      return;
+    }
+
+  d = &devices[device_cnt++];
+  d->bus = bus;
+  d->dev = dev;
+  d->func = func;
+
+  id = read_config (bus, dev, func, PCI_REG_ID);
+  d->vendor_id = id;
+  d->device_id = id >> 16;
+
+  class = read_config (bus, dev, func, PCI_REG_CLASS);
+  d->class = class >> 24;
+  d->subclass = class >> 16;
+  d->prog_if = class >> 8;
+
+  d->irq = read_config (bus, dev, func, PCI_REG_INTR);
+  for (i = 0; i < 6; i++)
+    d->bar[i] = read_config (bus, dev, func, PCI_REG_BAR0 + 4 * i);
+}
@@ -0,0 +1,56 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "threads/interrupt.h"
+
+/* Configuration space registers. */
+#define PCI_REG_ID 0x00          /* Device ID : Vendor ID. */
+#define PCI_REG_COMMAND 0x04     /* Status : Command. */
+#define PCI_REG_CLASS 0x08       /* Class : Subclass : Prog IF : Revision. */
+#define PCI_REG_HEADER 0x0c      /* BIST : Header type : Latency : Cache line. */
+#define PCI_REG_BAR0 0x10        /* First of 6 base address registers. */
+#define PCI_REG_INTR 0x3c        /* ... : Interrupt pin : Interrupt line. */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001        /* Respond to I/O space accesses. */
+#define PCI_CMD_MEM 0x0002       /* Respond to memory space accesses. */
+#define PCI_CMD_MASTER 0x0004    /* Allow bus mastering. */
+
+/* A function found on a PCI bus. */
+struct pci_device
+  {
+    uint8_t bus, dev, func;     /* Location. */
+    uint16_t vendor_id;         /* Vendor ID. */
+    uint16_t device_id;         /* Device ID. */
+    uint8_t class;              /* Base class, e.g. 0x01 for storage. */
+    uint8_t subclass;           /* Subclass, e.g. 0x01 for IDE. */
+    uint8_t prog_if;            /* Programming interface. */
+    uint8_t irq;                /* Interrupt line, 0xff if none. */
+    uint32_t bar[6];            /* Base address registers. */
+  };
+
+void pci_init (void);
+
+struct pci_device *pci_find (uint16_t vendor_id, uint16_t device_id,
+                             struct pci_device *after);
+struct pci_device *pci_find_class (uint8_t class, uint8_t subclass,
+                                   struct pci_device *after);
+
+uint32_t pci_read_config (const struct pci_device *, int reg);
+void pci_write_config16 (const struct pci_device *, int reg, uint16_t);
+void pci_enable (const struct pci_device *, uint16_t command_bits);
+void pci_register_handler (const struct pci_device *, intr_handler_func *,
+                           const char *name);
+volatile void *pci_map_mem (uint32_t paddr, size_t size);
+
+/* Returns the I/O port base of I/O space BAR VALUE, or 0 if the BAR
+   is not an I/O BAR. */
+#define PCI_BAR_IO(VALUE) ((VALUE) & 1 ? (uint16_t) ((VALUE) & ~3u) : 0)
+
+/* Returns the physical address of memory space BAR VALUE, or 0 if
+   the BAR is not a memory BAR. */
+#define PCI_BAR_MEM(VALUE) ((VALUE) & 1 ? 0 : (uint32_t) ((VALUE) & ~0xfu))
+
+#endif /* devices/pci.h */
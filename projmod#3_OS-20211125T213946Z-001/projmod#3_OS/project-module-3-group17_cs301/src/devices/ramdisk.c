@@ -0,0 +1,134 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A block device kept in memory.  Its contents start out zeroed
+   and are lost at shutdown, so a file system on it must be
+   formatted at every boot.  It has no seek or transfer latency,
+   which makes it useful to measure the software overhead of the
+   layers above, and to keep swap in memory when there is plenty of
+   it. */
+
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* -ramdisk: Size in kB, 0 for no RAM disk. */
+static size_t ramdisk_kb;
+
+/* Pages holding the sectors, SECTORS_PER_PAGE per page. */
+static uint8_t **pages;
+static size_t page_cnt;
+
+static struct block_operations ramdisk_operations;
+
+/* Asks for a RAM disk of KB kilobytes, rounded up to whole pages,
+   to be created by ramdisk_init().  Called while parsing the
+   command line, before memory is set up. */
+void
+ramdisk_set_size (size_t kb)
+{
+  ramdisk_kb = kb;
+}
+
+/* Creates and registers the RAM disk "rd0", if one was asked for.
+   Its pages come from the kernel pool, or from the user pool once
+   the kernel pool runs low, and are zeroed. */
+void
+ramdisk_init (void)
+{
+  size_t i;
+
+  if (ramdisk_kb == 0)
+    return;
+
+  page_cnt = DIV_ROUND_UP (ramdisk_kb * 1024, PGSIZE);
+  pages = malloc (page_cnt * sizeof *pages);
+  if (pages == NULL)
+    PANIC ("rd0: cannot allocate page table for %zu pages", page_cnt);
+  for (i = 0; i < page_cnt; i++)
+    {
+      pages[i] = palloc_get_page (PAL_ZERO);
+      if (pages[i] == NULL)
+        pages[i] = palloc_get_page (PAL_USER | PAL_ZERO);
+      if (pages[i] == NULL)
+        PANIC ("rd0: out of memory after %zu of %zu pages", i, page_cnt);
+    }
+
+  block_register ("rd0", BLOCK_RAW, "RAM disk", page_cnt * SECTORS_PER_PAGE,
+                  &ramdisk_operations, NULL);
+}
+
+/* Returns the address of SECTOR's data. */
+static uint8_t *
+sector_addr (block_sector_t sector)
+{
+  return (pages[sector / SECTORS_PER_PAGE]
+          + sector % SECTORS_PER_PAGE * BLOCK_SECTOR_SIZE);
+}
+
+/* Reads CNT sectors starting at SECTOR into BUFFER, one page's
+   worth of contiguous sectors at a time. */
+static void
+ramdisk_read_multiple (void *aux UNUSED, block_sector_t sector, size_t cnt,
+                       void *buffer_)
+{
+  uint8_t *buffer = buffer_;
+
+  while (cnt > 0)
+    {
+      size_t run = SECTORS_PER_PAGE - sector % SECTORS_PER_PAGE;
+      if (run > cnt)
+        run = cnt;
+      memcpy (buffer, sector_addr (sector), run * BLOCK_SECTOR_SIZE);
+      buffer += run * BLOCK_SECTOR_SIZE;
+      sector += run;
+      cnt -= run;
+    }
+}
+
+/* Writes CNT sectors starting at SECTOR from BUFFER, one page's
+   worth of contiguous sectors at a time. */
+static void
+ramdisk_write_multiple (void *aux UNUSED, block_sector_t sector, size_t cnt,
+                        const void *buffer_)
+{
+  const uint8_t *buffer = buffer_;
+
+  while (cnt > 0)
+    {
+      size_t run = SECTORS_PER_PAGE - sector % SECTORS_PER_PAGE;
+      if (run > cnt)
+        run = cnt;
+      memcpy (sector_addr (sector), buffer, run * BLOCK_SECTOR_SIZE);
+      buffer += run * BLOCK_SECTOR_SIZE;
+      sector += run;
+      cnt -= run;
+    }
+}
+
+/* Reads sector SECTOR into BUFFER. */
+static void
+ramdisk_read (void *aux, block_sector_t sector, void *buffer)
+{
+  ramdisk_read_multiple (aux, sector, 1, buffer);
+}
+
+/* Writes sector SECTOR from BUFFER. */
+static void
+ramdisk_write (void *aux, block_sector_t sector, const void *buffer)
+{
+  ramdisk_write_multiple (aux, sector, 1, buffer);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_read_multiple,
+    ramdisk_write_multiple,
+    NULL
+  };
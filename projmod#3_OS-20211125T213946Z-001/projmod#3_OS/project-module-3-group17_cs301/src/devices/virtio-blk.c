@@ -0,0 +1,412 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file is an interface to virtio block devices,
+   the paravirtual disks of QEMU and KVM ("-drive if=virtio").
+   Only the legacy PCI interface is supported, which QEMU offers
+   for transitional devices by default.  See the "Virtual I/O
+   Device (VIRTIO)" specification, version 1.0, section 4.1.4.8
+   ("Legacy Interfaces: A Note on PCI Device Layout") and section
+   2.4 ("Virtqueues").
+
+   Unlike the IDE driver, which has the controller work on one
+   request at a time, this driver starts every request it is
+   given as soon as the queue has room for it, so the device can
+   work on up to SLOT_MAX of them at once and complete them in any
+   order. */
+
+#define VIRTIO_VENDOR 0x1af4            /* Red Hat, Inc. */
+#define VIRTIO_BLK_LEGACY 0x1001        /* Transitional block device. */
+
+/* Legacy I/O registers, relative to BAR 0. */
+#define reg_features(D) ((D)->io_base + 0x00)     /* Device features. */
+#define reg_guest_features(D) ((D)->io_base + 0x04)
+#define reg_queue_pfn(D) ((D)->io_base + 0x08)    /* Queue page number. */
+#define reg_queue_size(D) ((D)->io_base + 0x0c)
+#define reg_queue_select(D) ((D)->io_base + 0x0e)
+#define reg_queue_notify(D) ((D)->io_base + 0x10)
+#define reg_status(D) ((D)->io_base + 0x12)       /* Device status. */
+#define reg_isr(D) ((D)->io_base + 0x13)          /* Read to acknowledge. */
+#define reg_capacity(D) ((D)->io_base + 0x14)     /* 64-bit sector count. */
+
+/* Device status bits. */
+#define STA_ACKNOWLEDGE 0x01    /* Guest has noticed the device. */
+#define STA_DRIVER 0x02         /* Guest knows how to drive it. */
+#define STA_DRIVER_OK 0x04      /* Driver is ready. */
+#define STA_FAILED 0x80         /* Driver gave up. */
+
+/* Descriptor flags. */
+#define DESC_NEXT 0x0001        /* Chain continues in NEXT. */
+#define DESC_WRITE 0x0002       /* Device writes the buffer. */
+
+/* Request types and status values. */
+#define BLK_T_IN 0              /* Read. */
+#define BLK_T_OUT 1             /* Write. */
+#define BLK_S_OK 0
+
+/* Virtqueue descriptor. */
+struct vring_desc
+  {
+    uint64_t addr;              /* Physical address. */
+    uint32_t len;               /* Length in bytes. */
+    uint16_t flags;             /* DESC_* flags. */
+    uint16_t next;              /* Next descriptor if DESC_NEXT. */
+  };
+
+/* Ring of descriptor chains offered to the device. */
+struct vring_avail
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the next entry goes. */
+    uint16_t ring[];
+  };
+
+/* Ring of descriptor chains the device has finished with. */
+struct vring_used_elem
+  {
+    uint32_t id;                /* Head of the chain. */
+    uint32_t len;               /* Bytes written to it. */
+  };
+
+struct vring_used
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the device puts the next entry. */
+    struct vring_used_elem ring[];
+  };
+
+/* Header of a block request. */
+struct virtio_blk_hdr
+  {
+    uint32_t type;              /* BLK_T_IN or BLK_T_OUT. */
+    uint32_t reserved;
+    uint64_t sector;
+  };
+
+/* A request in flight.  Slot I always uses the chain of three
+   descriptors starting at 3 * I: header, data, status. */
+struct slot
+  {
+    struct virtio_blk_hdr hdr;
+    uint8_t status;
+    struct block_request *req;
+  };
+
+/* Most requests in flight per disk. */
+#define SLOT_MAX 32
+
+/* A virtio disk. */
+struct virtio_disk
+  {
+    char name[8];               /* Name, e.g. "vda". */
+    uint16_t io_base;           /* Base I/O port. */
+    unsigned irq;               /* Interrupt vector in use. */
+    block_sector_t capacity;    /* Size in sectors. */
+
+    /* Virtqueue, in QUEUE_PAGES pages from palloc. */
+    void *queue;
+    size_t queue_pages;
+    uint16_t queue_size;        /* Descriptors. */
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t used_idx;          /* Next used entry to look at. */
+
+    /* Slots.  FREE and FREE_CNT are protected by disabling
+       interrupts, since the interrupt handler releases slots. */
+    struct slot slots[SLOT_MAX];
+    size_t slot_cnt;
+    uint8_t free[SLOT_MAX];
+    size_t free_cnt;
+    struct semaphore free_slots; /* Up once per free slot. */
+  };
+
+/* Most disks supported. */
+#define DISK_MAX 4
+
+static struct virtio_disk disks[DISK_MAX];
+static size_t disk_cnt;
+
+static struct block_operations virtio_blk_operations;
+
+static bool setup_disk (struct virtio_disk *, struct pci_device *);
+static bool setup_queue (struct virtio_disk *);
+static void interrupt_handler (struct intr_frame *);
+
+/* Finds the virtio block devices on the PCI bus and registers
+   them, and their partitions, as block devices. */
+void
+virtio_blk_init (void)
+{
+  struct pci_device *pd = NULL;
+
+  while ((pd = pci_find (VIRTIO_VENDOR, VIRTIO_BLK_LEGACY, pd)) != NULL)
+    {
+      struct virtio_disk *d;
+      char extra_info[32];
+      struct block *block;
+
+      if (disk_cnt >= DISK_MAX)
+        {
+          printf ("virtio-blk: ignoring disks after the first %d\n",
+                  DISK_MAX);
+          break;
+        }
+      d = &disks[disk_cnt];
+      snprintf (d->name, sizeof d->name, "vd%c", (int) ('a' + disk_cnt));
+      if (!setup_disk (d, pd))
+        continue;
+      disk_cnt++;
+
+      snprintf (extra_info, sizeof extra_info, "virtio, queue depth %zu",
+                d->slot_cnt);
+      block = block_register (d->name, BLOCK_RAW, extra_info, d->capacity,
+                              &virtio_blk_operations, d);
+      partition_scan (block);
+    }
+}
+
+/* Brings up disk D, which is PCI function PD.  Returns true if
+   successful, false if D cannot be used. */
+static bool
+setup_disk (struct virtio_disk *d, struct pci_device *pd)
+{
+  uint32_t capacity_hi;
+
+  d->io_base = PCI_BAR_IO (pd->bar[0]);
+  if (d->io_base == 0 || pd->irq >= 16)
+    {
+      printf ("%s: no I/O ports or interrupt assigned\n", d->name);
+      return false;
+    }
+  d->irq = pd->irq + 0x20;
+  pci_enable (pd, PCI_CMD_IO | PCI_CMD_MASTER);
+
+  /* Reset, then tell the device we drive it without any optional
+     features. */
+  outb (reg_status (d), 0);
+  outb (reg_status (d), STA_ACKNOWLEDGE);
+  outb (reg_status (d), STA_ACKNOWLEDGE | STA_DRIVER);
+  inl (reg_features (d));
+  outl (reg_guest_features (d), 0);
+
+  if (!setup_queue (d))
+    {
+      outb (reg_status (d), STA_FAILED);
+      return false;
+    }
+
+  pci_register_handler (pd, interrupt_handler, "virtio-blk");
+
+  outb (reg_status (d), STA_ACKNOWLEDGE | STA_DRIVER | STA_DRIVER_OK);
+
+  /* Sector counts past 2 TB do not fit in a block_sector_t. */
+  d->capacity = inl (reg_capacity (d));
+  capacity_hi = inl (reg_capacity (d) + 4);
+  if (capacity_hi != 0)
+    d->capacity = (block_sector_t) -1;
+  return true;
+}
+
+/* Sets up queue 0 of disk D, its only queue, and the request
+   slots that use it.  Returns true if successful, false on
+   failure. */
+static bool
+setup_queue (struct virtio_disk *d)
+{
+  size_t avail_size, used_ofs, i;
+
+  outw (reg_queue_select (d), 0);
+  d->queue_size = inw (reg_queue_size (d));
+  if (d->queue_size < 3)
+    {
+      printf ("%s: no usable queue\n", d->name);
+      return false;
+    }
+
+  /* The legacy layout puts the used ring at the next page boundary
+     after the descriptors and the available ring. */
+  avail_size = sizeof *d->avail + d->queue_size * sizeof *d->avail->ring;
+  used_ofs = ROUND_UP (d->queue_size * sizeof *d->desc + avail_size, PGSIZE);
+  d->queue_pages = DIV_ROUND_UP (used_ofs + sizeof *d->used
+                                 + d->queue_size * sizeof *d->used->ring,
+                                 PGSIZE);
+  d->queue = palloc_get_multiple (PAL_ZERO, d->queue_pages);
+  if (d->queue == NULL)
+    {
+      printf ("%s: out of memory for queue\n", d->name);
+      return false;
+    }
+  d->desc = d->queue;
+  d->avail = (struct vring_avail *) (d->desc + d->queue_size);
+  d->used = (struct vring_used *) ((uint8_t *) d->queue + used_ofs);
+  d->used_idx = 0;
+
+  /* Chain each slot's descriptors once and for all.  Only the data
+     descriptor changes from one request to the next. */
+  d->slot_cnt = d->queue_size / 3;
+  if (d->slot_cnt > SLOT_MAX)
+    d->slot_cnt = SLOT_MAX;
+  for (i = 0; i < d->slot_cnt; i++)
+    {
+      struct slot *s = &d->slots[i];
+      struct vring_desc *desc = &d->desc[i * 3];
+
+      desc[0].addr = vtop (&s->hdr);
+      desc[0].len = sizeof s->hdr;
+      desc[0].flags = DESC_NEXT;
+      desc[0].next = i * 3 + 1;
+      desc[1].next = i * 3 + 2;
+      desc[2].addr = vtop (&s->status);
+      desc[2].len = sizeof s->status;
+      desc[2].flags = DESC_WRITE;
+      d->free[i] = i;
+    }
+  d->free_cnt = d->slot_cnt;
+  sema_init (&d->free_slots, d->slot_cnt);
+
+  outl (reg_queue_pfn (d), vtop (d->queue) >> PGBITS);
+  return true;
+}
+
+/* Starts REQ on the disk D_, waiting for a free slot first if
+   all of them are in use.  REQ's done callback is called from the
+   interrupt handler once the device has finished with it. */
+static void
+virtio_blk_start (void *d_, struct block_request *req)
+{
+  struct virtio_disk *d = d_;
+  struct vring_desc *data;
+  struct slot *s;
+  enum intr_level old_level;
+  size_t slot_no;
+
+  ASSERT (is_kernel_vaddr (req->buffer));
+
+  sema_down (&d->free_slots);
+  old_level = intr_disable ();
+  slot_no = d->free[--d->free_cnt];
+  intr_set_level (old_level);
+
+  s = &d->slots[slot_no];
+  s->hdr.type = req->write ? BLK_T_OUT : BLK_T_IN;
+  s->hdr.reserved = 0;
+  s->hdr.sector = req->sector;
+  s->status = 0xff;
+  s->req = req;
+  data = &d->desc[slot_no * 3 + 1];
+  data->addr = vtop (req->buffer);
+  data->len = req->cnt * BLOCK_SECTOR_SIZE;
+  data->flags = DESC_NEXT | (req->write ? 0 : DESC_WRITE);
+
+  /* The device may look at the ring as soon as the index moves, so
+     the entry must be in place first. */
+  old_level = intr_disable ();
+  d->avail->ring[d->avail->idx % d->queue_size] = slot_no * 3;
+  barrier ();
+  d->avail->idx++;
+  barrier ();
+  outw (reg_queue_notify (d), 0);
+  intr_set_level (old_level);
+}
+
+/* Moves CNT sectors starting at SEC_NO between disk D_ and BUFFER,
+   in the direction given by WRITE, and waits for the transfer to
+   finish. */
+static void
+virtio_blk_transfer (void *d_, block_sector_t sec_no, size_t cnt,
+                     void *buffer, bool write)
+{
+  struct block_request req;
+  struct semaphore done;
+
+  sema_init (&done, 0);
+  block_request_init (&req, sec_no, cnt, buffer, write,
+                      block_request_wakeup, &done);
+  virtio_blk_start (d_, &req);
+  sema_down (&done);
+}
+
+static void
+virtio_blk_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  virtio_blk_transfer (d_, sec_no, 1, buffer, false);
+}
+
+static void
+virtio_blk_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  virtio_blk_transfer (d_, sec_no, 1, (void *) buffer, true);
+}
+
+static void
+virtio_blk_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                          void *buffer)
+{
+  virtio_blk_transfer (d_, sec_no, cnt, buffer, false);
+}
+
+static void
+virtio_blk_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                           const void *buffer)
+{
+  virtio_blk_transfer (d_, sec_no, cnt, (void *) buffer, true);
+}
+
+static struct block_operations virtio_blk_operations =
+  {
+    virtio_blk_read,
+    virtio_blk_write,
+    virtio_blk_read_multiple,
+    virtio_blk_write_multiple,
+    virtio_blk_start
+  };
+
+/* Virtio interrupt handler.  Completes every request that the
+   disks on this line have finished. */
+static void
+interrupt_handler (struct intr_frame *f)
+{
+  struct virtio_disk *d;
+
+  for (d = disks; d < disks + disk_cnt; d++)
+    {
+      if (d->irq != f->vec_no)
+        continue;
+
+      inb (reg_isr (d));                /* Acknowledge interrupt. */
+      while (d->used_idx != *(volatile uint16_t *) &d->used->idx)
+        {
+          struct vring_used_elem *e;
+          struct block_request *req;
+          struct slot *s;
+          size_t slot_no;
+
+          barrier ();
+          e = &d->used->ring[d->used_idx++ % d->queue_size];
+          slot_no = e->id / 3;
+          ASSERT (slot_no < d->slot_cnt);
+          s = &d->slots[slot_no];
+          req = s->req;
+          if (s->status != BLK_S_OK)
+            PANIC ("%s: %s failed at sector %"PRDSNu" (status %d)",
+                   d->name, req->write ? "write" : "read", req->sector,
+                   s->status);
+
+          d->free[d->free_cnt++] = slot_no;
+          sema_up (&d->free_slots);
+          req->done (req, req->aux);
+        }
+    }
+}
@@ -4,6 +4,9 @@
 #include "lib/string.h"
 #include "threads/thread.h"
 #include "devices/timer.h"
+#include "threads/palloc.h"
+#include <round.h>
+#include <stdio.h>
 #include "cache.h"
 
 #define ENABLE_BUFFER_CACHE
@@ -14,43 +17,196 @@
 #endif
 
 static void bc_flush (struct buffer_cache_entry *entry);
-bool bc_get_and_lock_entry (struct buffer_cache_entry **ref_entry, block_sector_t sector);
+static void bc_write (block_sector_t sector, const void *buffer, off_t offset, off_t size, bool fresh);
+static void bc_entry_io (struct buffer_cache_entry *entry, bool write);
+static void bc_entry_wait_io (struct buffer_cache_entry *entry);
+static void bc_entry_io_done (struct buffer_cache_entry *entry);
+bool bc_get_and_lock_entry (struct buffer_cache_entry **ref_entry, block_sector_t sector, bool fill, bool prefetch);
 static struct buffer_cache_entry * bc_get_entry_by_sector (block_sector_t sector);
 static struct buffer_cache_entry * bc_get_free_entry (void);
+static bool bc_should_grow (void);
+static bool bc_grow (void);
+static size_t bc_reclaim (size_t page_cnt);
+static bool bc_page_claim (struct bc_page *p);
+static struct buffer_cache_entry * bc_pick_victim (bool dirty_ok);
+static void bc_mark_dirty (struct buffer_cache_entry *entry);
+static void bc_mark_clean (struct buffer_cache_entry *entry, bool written);
+static void bc_lock (void);
+static bool bc_data_idle (struct buffer_cache_entry *entry);
+static void bc_throttle (void);
+static void bc_write_behind (block_sector_t sector);
+static void bc_wake_writeback (void);
+static bool bc_direct_pending (block_sector_t sector);
+static struct buffer_cache_entry * bc_scan_lru (struct bc_queue *q, bool dirty_ok);
+static struct buffer_cache_entry * bc_scan_clock (struct bc_queue *q, bool dirty_ok);
+static void bc_assign (struct buffer_cache_entry *entry, block_sector_t sector);
+static void bc_touch (struct buffer_cache_entry *entry);
+static void bc_queue_push (struct bc_queue *q, struct buffer_cache_entry *entry);
+static void bc_queue_remove (struct buffer_cache_entry *entry);
+static void bc_ghost_add (block_sector_t sector);
+static bool bc_ghost_take (block_sector_t sector);
+static unsigned bc_ghost_hash (const struct hash_elem *e, void *aux);
+static bool bc_ghost_less (const struct hash_elem *a, const struct hash_elem *b, void *aux);
+static unsigned bc_index_hash (const struct hash_elem *e, void *aux);
+static bool bc_index_less (const struct hash_elem *a, const struct hash_elem *b, void *aux);
 
 #ifdef ENABLE_PERIODIC_FLUSH
 static void bc_daemon_flush(void *aux);
+static void bc_daemon_flush_timer(void *aux);
 #endif
 
 #ifdef ENABLE_READ_AHEAD
 static void bc_daemon_read_ahead(void *aux);
 #endif
 
-struct buffer_cache_entry cache [MAX_CACHE_SECTORS];
+/* Misses to let pass after growing failed before looking at free
+   memory again. */
+#define BC_GROW_BACKOFF 64
+
+/* Every page struct ever made. Append-only, so it can be walked
+   without the cache lock. */
+static struct bc_page **bc_pages;
+static size_t bc_page_cnt;
+static size_t bc_max_sectors = BC_DEFAULT_MAX_SECTORS;
+static size_t bc_sectors;                  /* Entries backed by a page. */
+static unsigned grow_backoff;              /* Misses until growing is retried. */
 struct lock cache_lock;
-block_sector_t read_ahead [MAX_READ_AHEAD];
+
+/* Counters. Those about the dirty list are protected by dirty_lock,
+   those about read-ahead requests by ra_lock, the rest by cache_lock. */
+static struct cache_stats stats;
+static struct hash cache_index;            /* Sector -> entry, valid entries only. */
+static struct buffer_cache_entry index_key; /* Lookup key, protected by cache_lock. */
+
+enum bc_policy bc_policy = BC_POLICY_2Q;
+
+/* Replacement queues, protected by cache_lock. Empty entries sit in
+   free_q. Under 2Q, sectors referenced once are kept in FIFO order in
+   a1in_q and sectors referenced again in LRU order in am_q, so a long
+   scan only ever recycles a1in_q. Under clock, am_q is the clock ring. */
+static struct bc_queue free_q;
+static struct bc_queue a1in_q;
+static struct bc_queue am_q;
+
+/* 2Q "A1out": sectors recently evicted from a1in_q, without data.
+   A miss on one of them goes straight to am_q. Protected by cache_lock. */
+struct bc_ghost
+{
+  block_sector_t sector;                   /* EMPTY_SECTOR if unused. */
+  struct hash_elem elem;                   /* Element in ghost_index. */
+};
+static struct bc_ghost *ghosts;           /* Ring, oldest at ghost_next. */
+static size_t ghost_cnt;
+static size_t ghost_next;
+static struct hash ghost_index;
+static struct bc_ghost ghost_key;
+
+/* Dirty entries in the order they became dirty, so the oldest are at
+   the front. dirty_lock is taken after elock and cache_lock, never
+   before. */
+static struct list dirty_list;
+static size_t dirty_cnt;
+static struct lock dirty_lock;
+static struct condition dirty_ok;          /* Signaled when dirty_cnt drops. */
+static struct semaphore wb_wakeup;         /* Ups the write-back daemon. */
+static bool wb_kicked;                     /* wb_wakeup already upped. */
+
+/* Write-behind: the run of consecutive sectors whose last byte was
+   written, and the completed run the daemon should write next.
+   Protected by dirty_lock. */
+static block_sector_t wb_run_start, wb_run_end;
+static block_sector_t wb_done_start;
+static size_t wb_done_cnt;
+
+/* A direct write in progress: misses on its sector wait for it so
+   that the old contents cannot be read back into the cache. */
+struct bc_direct
+{
+  block_sector_t sector;
+  struct list_elem elem;                   /* Element in direct_list. */
+};
+static struct list direct_list;            /* Protected by cache_lock. */
+
+/* Sectors waiting to be prefetched, oldest first. */
+static block_sector_t ra_queue[BC_READ_AHEAD_QUEUE];
+static size_t ra_head;                     /* Index of the oldest request. */
+static size_t ra_cnt;                      /* Number of queued requests. */
+static struct lock ra_lock;                /* Protects the queue. */
+static struct condition ra_not_empty;      /* Signaled when a request is queued. */
 bool daemon_started;
-struct semaphore rh_sema;
 
 void bc_init ()
 {
+  lock_init(&cache_lock);
+
 #ifdef ENABLE_BUFFER_CACHE
-  for (int i = 0; i < MAX_CACHE_SECTORS; i++)
-  {
-    struct buffer_cache_entry *entry = &cache[i];
-    entry->sector = EMPTY_SECTOR;
-    entry->is_in_second_chance = false;
-    entry->is_dirty = false;
-    entry->readers = 0;
-    lock_init (&cache[i].elock);
-  }
+  list_init (&free_q.list);
+  list_init (&a1in_q.list);
+  list_init (&am_q.list);
+  free_q.cnt = a1in_q.cnt = am_q.cnt = 0;
+
+  bc_pages = malloc (sizeof *bc_pages * (bc_max_sectors / BC_SECTORS_PER_PAGE));
+  ghost_cnt = BC_2Q_KOUT (bc_max_sectors);
+  ghosts = malloc (sizeof *ghosts * ghost_cnt);
+  if (bc_pages == NULL || ghosts == NULL)
+    PANIC ("Buffer cache allocation failed");
+  bc_page_cnt = bc_sectors = 0;
+  grow_backoff = 0;
+
+  while (bc_sectors < BC_MIN_SECTORS)
+    if (!bc_grow ())
+      PANIC ("Buffer cache allocation failed");
+  palloc_set_reclaim (bc_reclaim);
 #endif
 
-  lock_init(&cache_lock);
-  sema_init(&rh_sema, 0);
+  if (!hash_init (&cache_index, bc_index_hash, bc_index_less, NULL)
+      || !hash_init (&ghost_index, bc_ghost_hash, bc_ghost_less, NULL))
+    PANIC ("Buffer cache index allocation failed");
+  for (size_t i = 0; i < ghost_cnt; i++)
+    ghosts[i].sector = EMPTY_SECTOR;
+  ghost_next = 0;
+
+  list_init (&direct_list);
+  list_init (&dirty_list);
+  dirty_cnt = 0;
+  lock_init (&dirty_lock);
+  cond_init (&dirty_ok);
+  sema_init (&wb_wakeup, 0);
+  wb_kicked = false;
+  wb_run_start = wb_run_end = EMPTY_SECTOR;
+  wb_done_cnt = 0;
+
+  lock_init (&ra_lock);
+  cond_init (&ra_not_empty);
+  ra_head = ra_cnt = 0;
   daemon_started = false;
 }
 
+/* Sets the most sectors the cache may grow to. Call before bc_init. */
+void bc_set_max_sectors (size_t sectors)
+{
+  ASSERT (bc_pages == NULL);
+
+  if (sectors < BC_MIN_SECTORS)
+    sectors = BC_MIN_SECTORS;
+  bc_max_sectors = ROUND_UP (sectors, BC_SECTORS_PER_PAGE);
+}
+
+/* Selects the replacement policy by NAME ("clock" or "2q").
+   Returns false if NAME is not a known policy. */
+bool bc_set_policy (const char *name)
+{
+  if (name == NULL)
+    return false;
+  if (!strcmp (name, "clock"))
+    bc_policy = BC_POLICY_CLOCK;
+  else if (!strcmp (name, "2q"))
+    bc_policy = BC_POLICY_2Q;
+  else
+    return false;
+  return true;
+}
+
 void bc_start_daemon ()
 {
   ASSERT (!daemon_started);
@@ -58,6 +214,8 @@ void bc_start_daemon ()
 #ifdef ENABLE_PERIODIC_FLUSH 
   tid_t t = thread_create("bc flush daemon", PRI_DEFAULT, bc_daemon_flush, NULL);
   ASSERT (t != TID_ERROR);
+  t = thread_create("bc flush timer", PRI_DEFAULT, bc_daemon_flush_timer, NULL);
+  ASSERT (t != TID_ERROR);
 #endif
 
 #ifdef ENABLE_READ_AHEAD
@@ -74,24 +232,17 @@ void bc_block_read (block_sector_t sector, void *buffer, off_t offset, off_t siz
 
 #ifdef ENABLE_BUFFER_CACHE
   struct buffer_cache_entry *cache_entry = NULL;
-  bool is_cache_miss = bc_get_and_lock_entry (&cache_entry, sector); //acquires elock
-
-  lock_acquire (&cache_lock); 
-  if(is_cache_miss)
-      block_read (fs_device, sector, cache_entry->data);
-  lock_release (&cache_lock);
+  bc_get_and_lock_entry (&cache_entry, sector, true, false); //acquires elock
 
   cache_entry->is_in_second_chance = false;
-  cache_entry->readers ++;
+  rw_read_acquire (&cache_entry->data_lock); //entry will not be evicted while held
   lock_release(&cache_entry->elock);
   
   memcpy (buffer, cache_entry->data + offset, size);
 
-  lock_acquire(&cache_entry->elock);
-  cache_entry->readers --; //entry will not be evicted, readers > 0
-  lock_release(&cache_entry->elock);
+  rw_read_release (&cache_entry->data_lock);
 #else
-  lock_acquire(&cache_lock);
+  bc_lock ();
   uint8_t *bounce = malloc (BLOCK_SECTOR_SIZE);
   if (bounce == NULL)
     PANIC ("Malloc failed!");
@@ -104,107 +255,209 @@ void bc_block_read (block_sector_t sector, void *buffer, off_t offset, off_t siz
 }
 
 /* Guarantees to find and return an entry allocated for the given sector.
-   Returns true in case of cache HIT, false otherwise. If the return is 
-   false, the data field will not be valid. Call with cache lock DISABLED
+   Returns true in case of cache MISS, false otherwise. On a miss the
+   entry is filled from disk if FILL is true; otherwise its data field
+   is not valid and the caller must initialize it before releasing elock.
+   PREFETCH is set by the read-ahead daemon, whose loads are counted
+   apart from demand misses.
+   The cache lock is only held while looking up and changing the index:
+   waiting for a busy entry and disk transfers happen without it.
+   Call with cache lock DISABLED
 */
-bool bc_get_and_lock_entry (struct buffer_cache_entry **ref_entry, block_sector_t sector)
+bool bc_get_and_lock_entry (struct buffer_cache_entry **ref_entry, block_sector_t sector, bool fill, bool prefetch)
 {
-  bool found = false;
-  bool is_cache_miss;
   struct buffer_cache_entry *e;
 
-  do
+  for (;;)
   {
-    lock_acquire (&cache_lock);
+    bc_lock ();
     e = bc_get_entry_by_sector(sector);
 
-    if (e == NULL)
-      { /* CACHE MISS */
-        is_cache_miss = true;
-        e = bc_get_free_entry (); //will acquire elock
-        e->sector = sector;
-        e->is_dirty = false;
-      }
-    else
+    if (e != NULL)
       { /* CACHE HIT */
-        is_cache_miss = false;
+        bc_touch (e);
+        if (!prefetch)
+          {
+            stats.hits++;
+            if (e->prefetched)
+              stats.ra_used++;
+            e->prefetched = false;
+          }
+        lock_release (&cache_lock);
         lock_acquire (&e->elock);
+        bc_entry_wait_io (e);
+
+        if (e->sector == sector)
+          break;
+
+        /* Evicted or removed while we were waiting */
+        lock_release (&e->elock);
+        continue;
+      }
+
+    /* CACHE MISS */
+    if (bc_direct_pending (sector))
+      { /* Let the direct write land first */
+        lock_release (&cache_lock);
+        thread_yield ();
+        continue;
+      }
+
+    if (free_q.cnt == 0 && bc_should_grow ())
+      {
+        lock_release (&cache_lock);
+        bc_grow ();
+        continue;
       }
-    
-    ASSERT (lock_held_by_current_thread(&e->elock));
 
-    found = sector == e->sector;
+    e = bc_get_free_entry (); //acquires elock
+    if (e == NULL)
+      { /* Every entry is busy: let their owners make progress */
+        lock_release (&cache_lock);
+        thread_yield ();
+        continue;
+      }
 
-    if (!found)
-      lock_release (&e->elock);
+    if (e->is_dirty)
+      { /* Write the victim back without the cache lock, then retry */
+        stats.sync_writebacks++;
+        lock_release (&cache_lock);
+        bc_flush (e);
+        lock_release (&e->elock);
+        continue;
+      }
 
+    bc_assign (e, sector);
+    e->prefetched = prefetch;
+    if (prefetch)
+      stats.ra_reads++;
+    else
+      stats.misses++;
     lock_release (&cache_lock);
 
-  } while (!found);
+    if (fill)
+      bc_entry_io (e, false);
+
+    ASSERT (lock_held_by_current_thread(&e->elock));
+    *ref_entry = e;
+    return true;
+  }
 
   ASSERT (e != NULL);
   ASSERT (e->sector == sector);
   ASSERT (lock_held_by_current_thread(&e->elock));
 
   *ref_entry = e;
-  return is_cache_miss;
+  return false;
 }
 
+/* Queues SECTOR to be brought into the cache by the read-ahead
+   daemon. The request is dropped if the queue is full: read-ahead
+   is only a hint. */
 void bc_request_read_ahead (block_sector_t sector UNUSED /*when RH disabled*/)
 {
 #ifdef ENABLE_READ_AHEAD
-  for (int i = 0; i < MAX_READ_AHEAD; i++)
+  lock_acquire (&ra_lock);
+  stats.ra_requests++;
+  if (ra_cnt < BC_READ_AHEAD_QUEUE)
     {
-      if (read_ahead[i] != EMPTY_SECTOR)
-      {
-        read_ahead[i] = sector;
-        sema_up (&rh_sema);
-        return;
-      }
+      ra_queue[(ra_head + ra_cnt) % BC_READ_AHEAD_QUEUE] = sector;
+      ra_cnt++;
+      cond_signal (&ra_not_empty, &ra_lock);
     }
+  else
+    stats.ra_dropped++;
+  lock_release (&ra_lock);
 #endif
 }
 
 void bc_block_write (block_sector_t sector, void *buffer, off_t offset, off_t size)
 {
+  bc_write (sector, buffer, offset, size, false);
+}
+
+/* Like bc_block_write(), for a sector just allocated to a file:
+   whatever it held before is never read from disk, and the bytes
+   around the ones written read back as zeros. */
+void bc_block_write_new (block_sector_t sector, const void *buffer, off_t offset, off_t size)
+{
+  bc_write (sector, buffer, offset, size, true);
+}
+
+/* Makes SECTOR, just allocated to a file, read back as zeros
+   without reading it from disk.  Its cache entry is zeroed and
+   written back like any other, so nothing reaches the disk if the
+   sector is written over or freed first. */
+void bc_block_zero (block_sector_t sector)
+{
+#ifdef ENABLE_BUFFER_CACHE
+  struct buffer_cache_entry *cache_entry = NULL;
+
+  bc_throttle ();
+
+  bc_get_and_lock_entry (&cache_entry, sector, false, false); //acquires elock
+
+  rw_write_acquire (&cache_entry->data_lock);
+  memset (cache_entry->data, 0, BLOCK_SECTOR_SIZE);
+  cache_entry->is_in_second_chance = false;
+  if (!cache_entry->is_dirty)
+    bc_mark_dirty (cache_entry);
+  rw_write_release (&cache_entry->data_lock);
+
+  lock_release(&cache_entry->elock);
+#else
+  bc_lock ();
+  uint8_t *bounce = calloc (1, BLOCK_SECTOR_SIZE);
+  if (bounce == NULL)
+    PANIC ("Malloc failed!");
+
+  block_write (fs_device, sector, bounce);
+  free (bounce);
+  lock_release(&cache_lock);
+#endif
+}
+
+/* Copies SIZE bytes from BUFFER to OFFSET in SECTOR.  Unless FRESH,
+   the rest of the sector is kept, which takes reading it first on
+   a partial write that misses. */
+static void bc_write (block_sector_t sector, const void *buffer, off_t offset, off_t size, bool fresh)
+{
+  ASSERT (buffer != NULL);
 #ifdef ENABLE_BUFFER_CACHE
   ASSERT (offset + size <= BLOCK_SECTOR_SIZE);
 
   struct buffer_cache_entry *cache_entry = NULL;
-  bool is_allowed;
+  bool partial = offset > 0 || size + offset < BLOCK_SECTOR_SIZE;
   bool is_cache_miss;
 
-  while (!is_allowed)
-  {
-    is_cache_miss = bc_get_and_lock_entry (&cache_entry, sector); //acquires elock
+  bc_throttle ();
 
-    if(is_cache_miss)
-    {
-      if (offset > 0 || 
-          size + offset < BLOCK_SECTOR_SIZE) 
-          block_read (fs_device, sector, cache_entry->data);
-        else
-          memset (cache_entry->data, 0, BLOCK_SECTOR_SIZE);
-    }
-
-    is_allowed = cache_entry->readers == 0;
+  is_cache_miss = bc_get_and_lock_entry (&cache_entry, sector, partial && !fresh, false); //acquires elock
 
-    if (!is_allowed)
-      lock_release(&cache_entry->elock);
-  }
+  if (is_cache_miss && !partial)
+    memset (cache_entry->data, 0, BLOCK_SECTOR_SIZE);
 
+  /* Readers copy out without elock: wait for them to finish */
+  rw_write_acquire (&cache_entry->data_lock);
+  if (fresh && partial)
+    memset (cache_entry->data, 0, BLOCK_SECTOR_SIZE);
   cache_entry->is_in_second_chance = false;
-  cache_entry->is_dirty = true;
+  if (!cache_entry->is_dirty)
+    bc_mark_dirty (cache_entry);
   memcpy (cache_entry->data + offset, buffer, size);
+  rw_write_release (&cache_entry->data_lock);
 
   lock_release(&cache_entry->elock);
+
+  if (offset + size == BLOCK_SECTOR_SIZE)
+    bc_write_behind (sector);
 #else
-  lock_acquire(&cache_lock);
+  bc_lock ();
   uint8_t *bounce = malloc (BLOCK_SECTOR_SIZE);
   if (bounce == NULL)
     PANIC ("Malloc failed!");
 
-  if (offset > 0 || size + offset < BLOCK_SECTOR_SIZE)
+  if (!fresh && (offset > 0 || size + offset < BLOCK_SECTOR_SIZE))
     block_read (fs_device, sector, bounce);
   else
     memset (bounce, 0, BLOCK_SECTOR_SIZE);
@@ -219,176 +472,877 @@ void bc_block_write (block_sector_t sector, void *buffer, off_t offset, off_t si
 void bc_flush_all (void)
 {
 #ifdef ENABLE_BUFFER_CACHE
-  lock_acquire(&cache_lock);
-  int count = 0;
-  for (int i = 0; i < MAX_CACHE_SECTORS; i++)
+  for (size_t i = 0; i < bc_page_cnt; i++)
+    for (int j = 0; j < BC_SECTORS_PER_PAGE; j++)
     {
-      struct buffer_cache_entry *entry = &cache[i];
+      struct buffer_cache_entry *entry = &bc_pages[i]->entries[j];
       lock_acquire (&entry->elock);
-      count ++;
+      bc_entry_wait_io (entry);
       if (entry->sector != EMPTY_SECTOR && entry->is_dirty)
         {
           bc_flush(entry);
         }
       lock_release (&entry->elock);
     }
+#endif
+}
+
+/* Writes SECTOR to disk now if it is cached and dirty, and waits
+   until it is there.  Used where later writes must not reach the
+   disk before it, since the write-back daemon orders its batches
+   by sector only. */
+void bc_sync (block_sector_t sector UNUSED)
+{
+#ifdef ENABLE_BUFFER_CACHE
+  bc_lock ();
+  struct buffer_cache_entry *entry = bc_get_entry_by_sector (sector);
   lock_release(&cache_lock);
+
+  if (entry != NULL)
+    {
+      lock_acquire (&entry->elock);
+      bc_entry_wait_io (entry);
+      if (entry->sector == sector && entry->is_dirty) //double check for eviction
+        bc_flush (entry);
+      lock_release (&entry->elock);
+    }
 #endif
 }
 
 /* Get a fresh entry to use, either via allocating or 
    eviction. Call with cache lock ENABLED.
-   The returned entry will be locked by the current thread */
+   Never blocks: entries that are locked, being read or doing I/O
+   are skipped, so the cache lock is never held while waiting.
+   The returned entry will be locked by the current thread and may
+   still be dirty, in which case the caller must write it back first.
+   Returns NULL if every entry is busy. */
 static struct buffer_cache_entry * bc_get_free_entry ()
 {
-  struct buffer_cache_entry *victim = NULL;
-  int round = 0;
-  for (int i = 0; i < MAX_CACHE_SECTORS;)
-  {
-    bool allow_halt = round > 5;
+  struct buffer_cache_entry *e = bc_scan_lru (&free_q, false);
+  if (e != NULL)
+    return e;
+
+  /* Prefer clean victims: dirty data is the write-back daemon's job,
+     so only write synchronously if nothing clean is left. */
+  e = bc_pick_victim (false);
+  if (e == NULL)
+    {
+      bc_wake_writeback ();
+      e = bc_pick_victim (true);
+    }
+  return e;
+}
+
+/* Picks a victim by the replacement policy, skipping dirty entries
+   unless DIRTY_OK. Call with cache lock ENABLED. */
+static struct buffer_cache_entry * bc_pick_victim (bool dirty_ok)
+{
+  struct buffer_cache_entry *e;
 
-    struct buffer_cache_entry *entry = &cache[i];
+  if (bc_policy == BC_POLICY_CLOCK)
+    return bc_scan_clock (&am_q, dirty_ok);
 
-    bool taken;
-    if(allow_halt)
+  /* 2Q: recycle first-time references while they hold more than
+     their share, so a scan cannot push out the hot set. */
+  if (a1in_q.cnt > BC_2Q_KIN (bc_sectors))
     {
-      lock_acquire (&entry->elock);
-      taken = true;
+      e = bc_scan_lru (&a1in_q, dirty_ok);
+      return e != NULL ? e : bc_scan_lru (&am_q, dirty_ok);
+    }
+  e = bc_scan_lru (&am_q, dirty_ok);
+  return e != NULL ? e : bc_scan_lru (&a1in_q, dirty_ok);
+}
+
+/* Whether a miss should add a page instead of evicting: the cache
+   is below its maximum and the kernel pool has memory to spare.
+   Call with cache lock ENABLED. */
+static bool bc_should_grow ()
+{
+  if (bc_sectors + BC_SECTORS_PER_PAGE > bc_max_sectors)
+    return false;
+  if (grow_backoff > 0)
+    {
+      grow_backoff--;
+      return false;
+    }
+  if (palloc_free_cnt (0) > BC_KERNEL_RESERVE_PAGES)
+    return true;
+
+  grow_backoff = BC_GROW_BACKOFF;
+  return false;
+}
+
+/* Backs BC_SECTORS_PER_PAGE more entries with a fresh kernel page
+   and puts them in the free queue. Returns false if no page could
+   be had or the cache is at its maximum size.
+   Call with cache lock DISABLED */
+static bool bc_grow ()
+{
+  uint8_t *kpage = palloc_get_page (0);
+  struct bc_page *p = NULL;
+
+  bc_lock ();
+  if (kpage == NULL || bc_sectors + BC_SECTORS_PER_PAGE > bc_max_sectors)
+    goto fail;
+
+  /* Reuse a page struct whose page was given back, if any */
+  for (size_t i = 0; i < bc_page_cnt && p == NULL; i++)
+    if (bc_pages[i]->kpage == NULL)
+      p = bc_pages[i];
+
+  if (p == NULL)
+    {
+      p = malloc (sizeof *p);
+      if (p == NULL)
+        goto fail;
+      for (int j = 0; j < BC_SECTORS_PER_PAGE; j++)
+        {
+          struct buffer_cache_entry *entry = &p->entries[j];
+          entry->sector = EMPTY_SECTOR;
+          entry->is_in_second_chance = false;
+          entry->is_dirty = false;
+          rw_init (&entry->data_lock);
+          entry->io_busy = false;
+          lock_init (&entry->elock);
+          cond_init (&entry->io_done);
+          entry->queue = NULL;
+          entry->prefetched = false;
+        }
+      bc_pages[bc_page_cnt] = p;
+      bc_page_cnt++;
     }
-    else
-      taken = lock_try_acquire (&entry->elock);
 
-    if(taken)
+  p->kpage = kpage;
+  for (int j = 0; j < BC_SECTORS_PER_PAGE; j++)
     {
-      bool readers_present = entry->readers > 0;
+      p->entries[j].data = (char *) kpage + j * BLOCK_SECTOR_SIZE;
+      bc_queue_push (&free_q, &p->entries[j]);
+    }
+  bc_sectors += BC_SECTORS_PER_PAGE;
+  stats.pages_grown++;
+  lock_release (&cache_lock);
+  return true;
 
-      if (!readers_present)
-      {
-        if(entry->sector == EMPTY_SECTOR || 
-           entry->is_in_second_chance)
-          {
-            victim = entry;
-            break;
-          }
-        else if (!entry->is_dirty || round > 0)
-            entry->is_in_second_chance = true;
-      }
+ fail:
+  grow_backoff = BC_GROW_BACKOFF;
+  lock_release (&cache_lock);
+  if (kpage != NULL)
+    palloc_free_page (kpage);
+  return false;
+}
 
+/* palloc reclaim hook: gives up to PAGE_CNT pages back, newest
+   first, never going below BC_MIN_SECTORS. Only pages whose entries
+   are all clean and idle are released. Never blocks, and does
+   nothing if called from inside the cache. Returns pages freed. */
+static size_t bc_reclaim (size_t page_cnt)
+{
+  size_t freed = 0;
+
+  if (lock_held_by_current_thread (&cache_lock)
+      || !lock_try_acquire (&cache_lock))
+    return 0;
+
+  for (size_t i = bc_page_cnt; i-- > 0 && freed < page_cnt; )
+    {
+      struct bc_page *p = bc_pages[i];
+
+      if (bc_sectors < BC_MIN_SECTORS + BC_SECTORS_PER_PAGE)
+        break;
+      if (p->kpage == NULL || !bc_page_claim (p))
+        continue;
+
+      for (int j = 0; j < BC_SECTORS_PER_PAGE; j++)
+        {
+          struct buffer_cache_entry *entry = &p->entries[j];
+          if (entry->sector != EMPTY_SECTOR)
+            hash_delete (&cache_index, &entry->index_elem);
+          if (entry->prefetched)
+            stats.ra_wasted++;
+          entry->prefetched = false;
+          bc_queue_remove (entry);
+          entry->sector = EMPTY_SECTOR;
+          entry->data = NULL;
+          lock_release (&entry->elock);
+        }
+      palloc_free_page (p->kpage);
+      p->kpage = NULL;
+      bc_sectors -= BC_SECTORS_PER_PAGE;
+      stats.pages_shrunk++;
+      freed++;
+    }
+
+  lock_release (&cache_lock);
+  return freed;
+}
+
+/* Locks every entry of P if all of them are clean and idle.
+   Returns false, holding none of them, otherwise. */
+static bool bc_page_claim (struct bc_page *p)
+{
+  int j;
+
+  for (j = 0; j < BC_SECTORS_PER_PAGE; j++)
+    {
+      struct buffer_cache_entry *entry = &p->entries[j];
+
+      if (lock_held_by_current_thread (&entry->elock)
+          || !lock_try_acquire (&entry->elock))
+        break;
+      if (entry->io_busy || entry->is_dirty || !bc_data_idle (entry))
+        {
+          lock_release (&entry->elock);
+          break;
+        }
+    }
+
+  if (j == BC_SECTORS_PER_PAGE)
+    return true;
+  while (j-- > 0)
+    lock_release (&p->entries[j].elock);
+  return false;
+}
+
+/* Returns the oldest entry of Q that is not busy, locked, or NULL.
+   Dirty entries count as busy unless DIRTY_OK. Busy entries are rare,
+   so this normally stops near the head. */
+static struct buffer_cache_entry * bc_scan_lru (struct bc_queue *q, bool dirty_ok)
+{
+  struct list_elem *el;
+
+  for (el = list_begin (&q->list); el != list_end (&q->list); el = list_next (el))
+    {
+      struct buffer_cache_entry *entry = list_entry (el, struct buffer_cache_entry, queue_elem);
+
+      if (!lock_try_acquire (&entry->elock))
+        continue;
+      if (!entry->io_busy && (dirty_ok || !entry->is_dirty)
+          && bc_data_idle (entry))
+        return entry;
       lock_release (&entry->elock);
     }
+  return NULL;
+}
 
-    if (i == MAX_CACHE_SECTORS - 1)
+/* Second chance over Q: the hand is the head of the list, and
+   entries passed over move to the tail, so each call continues
+   where the previous one stopped. Dirty entries are passed over
+   unless DIRTY_OK. Gives up after two turns. */
+static struct buffer_cache_entry * bc_scan_clock (struct bc_queue *q, bool dirty_ok)
+{
+  for (size_t n = 2 * q->cnt; n > 0; n--)
     {
-      i = 0;
-      round ++;
-      //ASSERT (round < 3);
+      struct list_elem *el = list_pop_front (&q->list);
+      struct buffer_cache_entry *entry = list_entry (el, struct buffer_cache_entry, queue_elem);
+
+      if (lock_try_acquire (&entry->elock))
+        {
+          if (!entry->io_busy && (dirty_ok || !entry->is_dirty)
+              && bc_data_idle (entry))
+            {
+              if (entry->is_in_second_chance)
+                {
+                  list_push_front (&q->list, el);
+                  return entry;
+                }
+              entry->is_in_second_chance = true;
+            }
+          lock_release (&entry->elock);
+        }
+      list_push_back (&q->list, el);
     }
-    else
-      i++;
-  }
+  return NULL;
+}
 
+/* Moves locked, clean ENTRY to SECTOR and files it in the queue the
+   policy picks for a new sector. Call with cache lock ENABLED. */
+static void bc_assign (struct buffer_cache_entry *entry, block_sector_t sector)
+{
+  struct bc_queue *q = &a1in_q;
 
-  ASSERT (victim != NULL);
-  ASSERT (lock_held_by_current_thread(&victim->elock))
-  
-  if(victim->sector != EMPTY_SECTOR && victim->is_dirty)
-    bc_flush (victim);
+  ASSERT (!entry->is_dirty);
 
-  return victim;
+  if (entry->sector != EMPTY_SECTOR)
+    {
+      hash_delete (&cache_index, &entry->index_elem);
+      if (entry->queue == &a1in_q)
+        bc_ghost_add (entry->sector);
+      stats.evictions++;
+      if (entry->prefetched)
+        stats.ra_wasted++;
+    }
+  bc_queue_remove (entry);
+
+  entry->sector = sector;
+  entry->is_in_second_chance = false;
+  hash_insert (&cache_index, &entry->index_elem);
+
+  if (bc_policy == BC_POLICY_CLOCK || bc_ghost_take (sector))
+    q = &am_q;
+  bc_queue_push (q, entry);
+}
+
+/* Records a hit on ENTRY. Under 2Q only re-referenced entries are
+   reordered; a hit in a1in_q is treated as part of the first
+   reference. Clock uses the entry's is_in_second_chance bit instead.
+   Call with cache lock ENABLED. */
+static void bc_touch (struct buffer_cache_entry *entry)
+{
+  if (bc_policy == BC_POLICY_2Q && entry->queue == &am_q)
+    {
+      list_remove (&entry->queue_elem);
+      list_push_back (&am_q.list, &entry->queue_elem);
+    }
+}
+
+static void bc_queue_push (struct bc_queue *q, struct buffer_cache_entry *entry)
+{
+  ASSERT (entry->queue == NULL);
+  list_push_back (&q->list, &entry->queue_elem);
+  q->cnt++;
+  entry->queue = q;
+}
+
+static void bc_queue_remove (struct buffer_cache_entry *entry)
+{
+  ASSERT (entry->queue != NULL);
+  list_remove (&entry->queue_elem);
+  entry->queue->cnt--;
+  entry->queue = NULL;
+}
+
+/* Remembers SECTOR as recently evicted, forgetting the oldest one. */
+static void bc_ghost_add (block_sector_t sector)
+{
+  struct bc_ghost *g = &ghosts[ghost_next];
+
+  if (g->sector != EMPTY_SECTOR)
+    hash_delete (&ghost_index, &g->elem);
+  g->sector = sector;
+  hash_replace (&ghost_index, &g->elem);
+  ghost_next = (ghost_next + 1) % ghost_cnt;
+}
+
+/* Forgets SECTOR if it was recently evicted. Returns whether it was. */
+static bool bc_ghost_take (block_sector_t sector)
+{
+  struct hash_elem *e;
+
+  ghost_key.sector = sector;
+  e = hash_delete (&ghost_index, &ghost_key.elem);
+  if (e == NULL)
+    return false;
+  hash_entry (e, struct bc_ghost, elem)->sector = EMPTY_SECTOR;
+  return true;
 }
 
+/* Writes ENTRY back to disk. Call with elock held. */
 static void bc_flush (struct buffer_cache_entry *entry)
 {
-  block_write (fs_device, entry->sector, entry->data);
-  entry->is_dirty = false;
+  bc_entry_io (entry, true);
+}
+
+/* Transfers ENTRY between memory and disk. Call with elock held.
+   The entry is marked busy and elock is dropped for the duration
+   of the transfer so that the lock is never held across disk I/O;
+   threads that need the entry wait on io_done instead. Returns
+   with elock held again. */
+static void bc_entry_io (struct buffer_cache_entry *entry, bool write)
+{
+  block_sector_t sector = entry->sector;
+
+  ASSERT (lock_held_by_current_thread (&entry->elock));
+  ASSERT (!entry->io_busy);
+  ASSERT (sector != EMPTY_SECTOR);
+
+  entry->io_busy = true;
+  if (write)
+    bc_mark_clean (entry, true);
+  lock_release (&entry->elock);
+
+  if (write)
+    block_write (fs_device, sector, entry->data);
+  else
+    block_read (fs_device, sector, entry->data);
+
+  lock_acquire (&entry->elock);
+  bc_entry_io_done (entry);
+}
+
+/* Ends the disk transfer on ENTRY and wakes the threads waiting
+   for it. Call with elock held. */
+static void bc_entry_io_done (struct buffer_cache_entry *entry)
+{
+  ASSERT (lock_held_by_current_thread (&entry->elock));
+  ASSERT (entry->io_busy);
+  entry->io_busy = false;
+  cond_broadcast (&entry->io_done, &entry->elock);
+}
+
+/* Waits until no disk transfer is in progress on ENTRY.
+   Call with elock held. */
+static void bc_entry_wait_io (struct buffer_cache_entry *entry)
+{
+  ASSERT (lock_held_by_current_thread (&entry->elock));
+  while (entry->io_busy)
+    cond_wait (&entry->io_done, &entry->elock);
 }
 
 void bc_remove (block_sector_t sector UNUSED)
 {
 #ifdef ENABLE_BUFFER_CACHE
-  lock_acquire(&cache_lock);
-  for (int i = 0; i < MAX_CACHE_SECTORS; i++)
-  {
-    struct buffer_cache_entry *entry = &cache[i];
-    if (entry->sector == sector)
+  bc_lock ();
+  struct buffer_cache_entry *entry = bc_get_entry_by_sector (sector);
+  lock_release(&cache_lock);
+
+  if (entry != NULL)
     {
       lock_acquire (&entry->elock);
+      bc_entry_wait_io (entry);
+      rw_write_acquire (&entry->data_lock);
+      bc_lock ();
       if (entry->sector == sector) //double check for eviction
-        entry->sector = EMPTY_SECTOR;
-      lock_release (&entry->elock);
+        {
+          hash_delete (&cache_index, &entry->index_elem);
+          bc_ghost_take (sector);
+          entry->prefetched = false;
+          bc_queue_remove (entry);
+          bc_queue_push (&free_q, entry);
+          entry->sector = EMPTY_SECTOR;
+          if (entry->is_dirty)
+            bc_mark_clean (entry, false);
+        }
       lock_release(&cache_lock);
-      return;
-    }  
-  }
-  lock_release(&cache_lock);
+      rw_write_release (&entry->data_lock);
+      lock_release (&entry->elock);
+    }
 #endif
 }
 
-/* Call with cache lock ENABLED */
-static struct buffer_cache_entry *bc_get_entry_by_sector (block_sector_t sector)
+/* Puts ENTRY on the dirty list. Call with elock held. */
+static void bc_mark_dirty (struct buffer_cache_entry *entry)
 {
-  struct buffer_cache_entry *entry;
-  for (int i = 0; i < MAX_CACHE_SECTORS; i++)
+  ASSERT (lock_held_by_current_thread (&entry->elock));
+  ASSERT (!entry->is_dirty);
+
+  entry->is_dirty = true;
+  lock_acquire (&dirty_lock);
+  entry->dirty_since = timer_ticks ();
+  list_push_back (&dirty_list, &entry->dirty_elem);
+  dirty_cnt++;
+  if (dirty_cnt > BC_DIRTY_BACKGROUND (bc_sectors))
+    bc_wake_writeback ();
+  lock_release (&dirty_lock);
+}
+
+/* Takes ENTRY off the dirty list and lets throttled writers go on.
+   WRITTEN tells whether it is being written back or just dropped.
+   Call with elock held. */
+static void bc_mark_clean (struct buffer_cache_entry *entry, bool written)
+{
+  ASSERT (lock_held_by_current_thread (&entry->elock));
+  ASSERT (entry->is_dirty);
+
+  entry->is_dirty = false;
+  lock_acquire (&dirty_lock);
+  list_remove (&entry->dirty_elem);
+  dirty_cnt--;
+  if (written)
+    stats.writebacks++;
+  cond_broadcast (&dirty_ok, &dirty_lock);
+  lock_release (&dirty_lock);
+}
+
+/* Makes the calling writer wait while too much of the cache is
+   dirty, so that eviction finds clean entries. Does nothing until
+   the write-back daemon runs. */
+static void bc_throttle ()
+{
+#ifdef ENABLE_PERIODIC_FLUSH
+  if (!daemon_started)
+    return;
+
+  lock_acquire (&dirty_lock);
+  while (dirty_cnt >= BC_DIRTY_HIGH (bc_sectors))
     {
-      entry = &cache[i];
-      if(entry->sector == sector)
-        return entry;
+      bc_wake_writeback ();
+      cond_wait (&dirty_ok, &dirty_lock);
     }
+  lock_release (&dirty_lock);
+#endif
+}
 
-  return NULL;
+/* Notes that the last byte of SECTOR was written. Once
+   BC_WRITE_BEHIND_RUN consecutive sectors are complete, they are
+   handed to the write-back daemon without waiting for them to age. */
+static void bc_write_behind (block_sector_t sector UNUSED)
+{
+#ifdef ENABLE_PERIODIC_FLUSH
+  lock_acquire (&dirty_lock);
+  if (wb_run_end != EMPTY_SECTOR && sector == wb_run_end + 1)
+    wb_run_end = sector;
+  else
+    wb_run_start = wb_run_end = sector;
+
+  if (wb_run_end - wb_run_start + 1 >= BC_WRITE_BEHIND_RUN && wb_done_cnt == 0)
+    {
+      wb_done_start = wb_run_start;
+      wb_done_cnt = wb_run_end - wb_run_start + 1;
+      wb_run_start = wb_run_end = EMPTY_SECTOR;
+      bc_wake_writeback ();
+    }
+  lock_release (&dirty_lock);
+#endif
+}
+
+/* Wakes the write-back daemon up if it isn't already. */
+static void bc_wake_writeback ()
+{
+  bool held = lock_held_by_current_thread (&dirty_lock);
+
+  if (!held)
+    lock_acquire (&dirty_lock);
+  if (!wb_kicked)
+    {
+      wb_kicked = true;
+      sema_up (&wb_wakeup);
+    }
+  if (!held)
+    lock_release (&dirty_lock);
 }
 
+/* Reads a whole SECTOR into BUFFER without bringing it into the
+   cache. A cached copy, which may be newer than the disk, is used
+   if there is one. */
+void bc_direct_read (block_sector_t sector, void *buffer)
+{
+#ifdef ENABLE_BUFFER_CACHE
+  bool cached;
+
+  bc_lock ();
+  cached = bc_get_entry_by_sector (sector) != NULL;
+  if (!cached)
+    stats.direct_reads++;
+  lock_release (&cache_lock);
+
+  if (cached)
+    {
+      bc_block_read (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+      return;
+    }
+#endif
+  block_read (fs_device, sector, buffer);
+}
+
+/* Writes a whole SECTOR from BUFFER straight to disk. Any cached
+   copy is dropped, dirty or not, since it is entirely overwritten. */
+void bc_direct_write (block_sector_t sector, const void *buffer)
+{
+#ifdef ENABLE_BUFFER_CACHE
+  struct bc_direct d;
+
+  d.sector = sector;
+  bc_lock ();
+  list_push_back (&direct_list, &d.elem);
+  stats.direct_writes++;
+  lock_release (&cache_lock);
+
+  bc_remove (sector);
+  block_write (fs_device, sector, buffer);
+
+  bc_lock ();
+  list_remove (&d.elem);
+  lock_release (&cache_lock);
+#else
+  block_write (fs_device, sector, buffer);
+#endif
+}
+
+/* Whether a direct write to SECTOR is in progress. There are only
+   ever as many as there are writing threads.
+   Call with cache lock ENABLED */
+static bool bc_direct_pending (block_sector_t sector)
+{
+  struct list_elem *el;
+
+  for (el = list_begin (&direct_list); el != list_end (&direct_list);
+       el = list_next (el))
+    if (list_entry (el, struct bc_direct, elem)->sector == sector)
+      return true;
+  return false;
+}
+
+/* Whether no thread is copying ENTRY's data. Readers only start
+   with elock held, so the answer stays true while the caller holds
+   it. Call with elock held. */
+static bool bc_data_idle (struct buffer_cache_entry *entry)
+{
+  if (!rw_write_try_acquire (&entry->data_lock))
+    return false;
+  rw_write_release (&entry->data_lock);
+  return true;
+}
+
+/* Acquires the cache lock, counting the times it had to wait and
+   for how long. */
+static void bc_lock ()
+{
+  int64_t start;
+
+  if (lock_try_acquire (&cache_lock))
+    return;
+
+  start = timer_ticks ();
+  lock_acquire (&cache_lock);
+  stats.lock_waits++;
+  stats.lock_wait_ticks += timer_ticks () - start;
+}
+
+/* Copies the cache counters into ST. */
+void bc_get_stats (struct cache_stats *st)
+{
+  bc_lock ();
+  lock_acquire (&dirty_lock);
+  lock_acquire (&ra_lock);
+  *st = stats;
+  st->sectors = bc_sectors;
+  st->max_sectors = bc_max_sectors;
+  st->dirty = dirty_cnt;
+  lock_release (&ra_lock);
+  lock_release (&dirty_lock);
+  lock_release (&cache_lock);
+}
+
+/* Prints buffer cache statistics. */
+void bc_print_stats (void)
+{
+  struct cache_stats st;
+
+  bc_get_stats (&st);
+  printf ("Buffer cache: %u/%u sectors, %llu hits, %llu misses, "
+          "%llu evictions, %llu write-backs (%llu on eviction)\n",
+          st.sectors, st.max_sectors, st.hits, st.misses,
+          st.evictions, st.writebacks, st.sync_writebacks);
+  printf ("Buffer cache read-ahead: %llu requested, %llu dropped, "
+          "%llu read, %llu used, %llu wasted\n",
+          st.ra_requests, st.ra_dropped, st.ra_reads, st.ra_used,
+          st.ra_wasted);
+  printf ("Buffer cache: %llu direct reads, %llu direct writes, "
+          "%llu pages grown, %llu shrunk, %llu lock waits (%llu ticks)\n",
+          st.direct_reads, st.direct_writes, st.pages_grown,
+          st.pages_shrunk, st.lock_waits, st.lock_wait_ticks);
+}
+
+/* Looks SECTOR up in the sector index.
+   Call with cache lock ENABLED */
+static struct buffer_cache_entry *bc_get_entry_by_sector (block_sector_t sector)
+{
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  index_key.sector = sector;
+  e = hash_find (&cache_index, &index_key.index_elem);
+  return e != NULL ? hash_entry (e, struct buffer_cache_entry, index_elem) : NULL;
+}
+
+static unsigned bc_index_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct buffer_cache_entry *entry = hash_entry (e, struct buffer_cache_entry, index_elem);
+  return hash_int (entry->sector);
+}
+
+static bool bc_index_less (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+  const struct buffer_cache_entry *ea = hash_entry (a, struct buffer_cache_entry, index_elem);
+  const struct buffer_cache_entry *eb = hash_entry (b, struct buffer_cache_entry, index_elem);
+  return ea->sector < eb->sector;
+}
+
+static unsigned bc_ghost_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct bc_ghost, elem)->sector);
+}
+
+static bool bc_ghost_less (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+  return hash_entry (a, struct bc_ghost, elem)->sector
+         < hash_entry (b, struct bc_ghost, elem)->sector;
+}
 
 #ifdef ENABLE_PERIODIC_FLUSH 
+/* A dirty entry picked for writing, with the sector it had then. */
+struct bc_writeback
+{
+  struct buffer_cache_entry *entry;
+  block_sector_t sector;
+};
+
+/* Write-back daemon. Each pass picks dirty entries that expired,
+   that push the dirty count over the background limit, or that
+   belong to a completed write-behind run, and queues them all at
+   once: the I/O scheduler sorts them so the disk sweeps in one
+   direction, and merges consecutive sectors into one transfer. */
 static void bc_daemon_flush(void *aux UNUSED)
 { 
+  static struct bc_writeback batch[BC_WRITEBACK_BATCH];
+  static struct block_request reqs[BC_WRITEBACK_BATCH];
+  struct semaphore done;
+
+  sema_init (&done, 0);
+
   while (true)
     {
-      lock_acquire(&cache_lock);
-      struct buffer_cache_entry *entry;
-      for (int i = 0; i < MAX_CACHE_SECTORS; i++)
+      size_t n = 0;
+      bool more = false;
+      block_sector_t wb_start;
+      size_t wb_cnt;
+
+      lock_acquire (&dirty_lock);
+      wb_kicked = false;
+      wb_start = wb_done_start;
+      wb_cnt = wb_done_cnt;
+      wb_done_cnt = 0;
+
+      int64_t now = timer_ticks ();
+      size_t over = dirty_cnt > BC_DIRTY_BACKGROUND (bc_sectors)
+                    ? dirty_cnt - BC_DIRTY_BACKGROUND (bc_sectors) : 0;
+      struct list_elem *el;
+      for (el = list_begin (&dirty_list); el != list_end (&dirty_list);
+           el = list_next (el))
         {
-          entry = &cache[i];
+          struct buffer_cache_entry *entry = list_entry (el, struct buffer_cache_entry, dirty_elem);
+          bool expired = now - entry->dirty_since >= BC_DIRTY_EXPIRE_MS * TIMER_FREQ / 1000;
+          bool in_run = entry->sector - wb_start < wb_cnt;
+
+          if (!expired && n >= over && !in_run)
+            {
+              if (wb_cnt == 0)
+                break;          /* The rest is younger still */
+              continue;
+            }
+          if (n == BC_WRITEBACK_BATCH)
+            {
+              more = true;
+              break;
+            }
+          batch[n].entry = entry;
+          batch[n].sector = entry->sector;
+          n++;
+        }
+      lock_release (&dirty_lock);
+
+      size_t queued = 0;
+      for (size_t i = 0; i < n; i++)
+        {
+          struct buffer_cache_entry *entry = batch[i].entry;
+          struct block_request *req = &reqs[queued];
+
           lock_acquire (&entry->elock);
-          if(entry->is_dirty)
-            bc_flush (entry);
+          if (entry->sector != batch[i].sector || !entry->is_dirty || entry->io_busy)
+            {
+              lock_release (&entry->elock);
+              continue;
+            }
+          entry->io_busy = true;
+          bc_mark_clean (entry, true);
           lock_release (&entry->elock);
+
+          block_request_init (req, batch[i].sector, 1, entry->data, true,
+                              block_request_wakeup, &done);
+          block_submit (fs_device, req);
+          batch[queued++].entry = entry;
         }
 
-      lock_release(&cache_lock);
+      for (size_t i = 0; i < queued; i++)
+        sema_down (&done);
+      for (size_t i = 0; i < queued; i++)
+        {
+          lock_acquire (&batch[i].entry->elock);
+          bc_entry_io_done (batch[i].entry);
+          lock_release (&batch[i].entry->elock);
+        }
+
+      if (!more)
+        sema_down (&wb_wakeup);
+    }
+}
 
+/* Wakes the write-back daemon every BC_DAEMON_FLUSH_SLEEP_MS so that
+   dirty data expires even when nothing else kicks it. */
+static void bc_daemon_flush_timer(void *aux UNUSED)
+{
+  while (true)
+    {
       timer_msleep (BC_DAEMON_FLUSH_SLEEP_MS);
+      bc_wake_writeback ();
     }
 }
 #endif
 
 #ifdef ENABLE_READ_AHEAD
+/* Read-ahead daemon. Takes up to BC_READ_AHEAD_BATCH requests at a
+   time and queues reads for the sectors not cached yet, straight into
+   their entries, so the I/O scheduler can merge and order them. The
+   entries stay busy until the whole batch is in. */
 static void bc_daemon_read_ahead(void *aux UNUSED)
 {
+  static struct block_request reqs[BC_READ_AHEAD_BATCH];
+  struct buffer_cache_entry *staged[BC_READ_AHEAD_BATCH];
+  block_sector_t sectors[BC_READ_AHEAD_BATCH];
+  struct semaphore done;
+
+  sema_init (&done, 0);
   while (true)
     {
-      sema_down (&rh_sema);
-      //lock_acquire(&cache_lock);
-      for (int i = 0; i < MAX_READ_AHEAD; i++)
+      size_t cnt = 0, n = 0;
+
+      lock_acquire (&ra_lock);
+      while (ra_cnt == 0)
+        cond_wait (&ra_not_empty, &ra_lock);
+      while (ra_cnt > 0 && cnt < BC_READ_AHEAD_BATCH)
         {
-          block_sector_t sector = read_ahead [i];
-          if(sector != EMPTY_SECTOR)
-            {
-              struct buffer_cache_entry *cache_entry = NULL;
-              bool is_cache_miss = bc_get_and_lock_entry (&cache_entry, sector); //acquires elock
- 
-              lock_acquire(&cache_lock);
-              if(is_cache_miss)
-                  block_read (fs_device, sector, cache_entry->data);
-              lock_release(&cache_lock);
-
-              cache_entry->is_in_second_chance = false;
+          sectors[cnt++] = ra_queue[ra_head];
+          ra_head = (ra_head + 1) % BC_READ_AHEAD_QUEUE;
+          ra_cnt--;
+        }
+      lock_release (&ra_lock);
+
+      for (size_t i = 0; i < cnt; i++)
+        {
+          struct buffer_cache_entry *cache_entry = NULL;
+          bool cached;
+
+          /* Don't wait on entries that are already there */
+          bc_lock ();
+          cached = bc_get_entry_by_sector (sectors[i]) != NULL;
+          lock_release (&cache_lock);
+          if (cached)
+            continue;
+
+          if (!bc_get_and_lock_entry (&cache_entry, sectors[i], false, true)) //acquires elock
+            { /* Loaded by someone else meanwhile */
               lock_release (&cache_entry->elock);
+              continue;
+            }
+          cache_entry->is_in_second_chance = false;
+          cache_entry->io_busy = true;
+          lock_release (&cache_entry->elock);
 
-              read_ahead [i] = EMPTY_SECTOR;
-            }  
+          block_request_init (&reqs[n], sectors[i], 1, cache_entry->data, false,
+                              block_request_wakeup, &done);
+          block_submit (fs_device, &reqs[n]);
+          staged[n++] = cache_entry;
+        }
+
+      for (size_t i = 0; i < n; i++)
+        sema_down (&done);
+      for (size_t i = 0; i < n; i++)
+        {
+          lock_acquire (&staged[i]->elock);
+          bc_entry_io_done (staged[i]);
+          lock_release (&staged[i]->elock);
         }
-      //lock_release(&cache_lock);
     }
 }
-#endif
\ No newline at end of file
+#endif
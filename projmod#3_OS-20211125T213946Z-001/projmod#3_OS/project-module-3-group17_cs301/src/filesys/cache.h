@@ -1,27 +1,86 @@
 #include "devices/block.h"
 #include "threads/synch.h"
 #include <list.h>
+#include <hash.h>
+#include <cache-stats.h>
 
-#define MAX_CACHE_SECTORS 64
-#define BC_DAEMON_FLUSH_SLEEP_MS 1000
-#define MAX_READ_AHEAD 10
+#include "threads/vaddr.h"
+
+#define BC_MIN_SECTORS 64                /* Initial size, never shrunk below */
+#define BC_DEFAULT_MAX_SECTORS 4096      /* Upper bound unless -bc-size is given */
+#define BC_SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+#define BC_KERNEL_RESERVE_PAGES 128      /* Kernel pages the cache leaves free */
+#define BC_DAEMON_FLUSH_SLEEP_MS 250      /* Write-back daemon period */
+#define BC_DIRTY_EXPIRE_MS 1000          /* Dirty data older than this is written */
+#define BC_DIRTY_BACKGROUND(SECTORS) ((SECTORS) / 4) /* Write oldest beyond this */
+#define BC_DIRTY_HIGH(SECTORS) ((SECTORS) / 2)       /* Writers wait beyond this */
+#define BC_WRITE_BEHIND_RUN 8            /* Completed sequential sectors to write early */
+#define BC_WRITEBACK_BATCH 64            /* Dirty sectors queued per write-back pass */
+#define BC_READ_AHEAD_QUEUE 128
+#define BC_READ_AHEAD_BATCH 16          /* Prefetches queued to the disk at once */
 #define EMPTY_SECTOR SIZE_MAX
 
+/* 2Q tuning: share of the cache given to first-time references, and
+   number of recently evicted sectors remembered (as in the 2Q paper). */
+#define BC_2Q_KIN(SECTORS) ((SECTORS) / 4)
+#define BC_2Q_KOUT(SECTORS) ((SECTORS) / 2)
+
+/* Replacement policies, selectable with -bc-policy. */
+enum bc_policy
+  {
+    BC_POLICY_CLOCK,                    /* Second chance over all entries. */
+    BC_POLICY_2Q                        /* Scan-resistant 2Q (default). */
+  };
+
+/* A list of entries plus its length, protected by the cache lock. */
+struct bc_queue
+  {
+    struct list list;
+    size_t cnt;
+  };
+
 struct buffer_cache_entry
 {
 	block_sector_t sector;              /* Sector number of disk location. */
-	char data [BLOCK_SECTOR_SIZE];		/* Data contained in the cache */
+	char *data;				/* Data contained in the cache, NULL if the page was given back */
 	bool is_in_second_chance;			/* Whether the entry is in second chance */			
 	bool is_dirty;						/* Whether the entry is in second dirty */	
-	unsigned int readers;
+	struct rwlock data_lock;			/* Shared while copying data out, exclusive while copying in */
+	bool io_busy;						/* Disk transfer in progress, elock not held */
 	struct lock elock;				/* Used to handle asynchronous reads */
+	struct condition io_done;			/* Signaled on elock when io_busy clears */
+	struct hash_elem index_elem;		/* Element in the sector index */
+	struct bc_queue *queue;			/* Replacement queue holding the entry */
+	struct list_elem queue_elem;		/* Element in that queue */
+	struct list_elem dirty_elem;		/* Element in the dirty list, if dirty */
+	int64_t dirty_since;			/* Timer tick the entry became dirty */
+	bool prefetched;			/* Read ahead and not accessed since, under cache_lock */
 };
 
+/* A page of sector data and the entries that use it. Never freed:
+   only the page itself is given back to palloc when memory is short. */
+struct bc_page
+{
+	uint8_t *kpage;				/* Kernel page, NULL while given back */
+	struct buffer_cache_entry entries [BC_SECTORS_PER_PAGE];
+};
+
+extern enum bc_policy bc_policy;
+
 void bc_init(void);
+bool bc_set_policy (const char *name);
+void bc_set_max_sectors (size_t sectors);
 void bc_start_daemon (void);
 void bc_block_read (block_sector_t sector, void *buffer, off_t offset, off_t size);
 void bc_request_read_ahead (block_sector_t sector);
 void bc_block_write (block_sector_t sector, void *buffer, off_t offset, off_t size);
+void bc_block_write_new (block_sector_t sector, const void *buffer, off_t offset, off_t size);
+void bc_block_zero (block_sector_t sector);
 void bc_remove (block_sector_t sector);
+void bc_direct_read (block_sector_t sector, void *buffer);
+void bc_direct_write (block_sector_t sector, const void *buffer);
 void bc_flush_all (void);
+void bc_sync (block_sector_t sector);
+void bc_get_stats (struct cache_stats *st);
+void bc_print_stats (void);
 
@@ -26,7 +26,6 @@ dir_open (struct inode *inode)
   if (inode != NULL && dir != NULL)
     {
       dir->inode = inode;
-      lock_init (&dir->dir_lock);
       dir->pos = 0;
       return dir;
     }
@@ -110,10 +109,14 @@ dir_lookup_entry (const struct dir *dir, const char *name,
 {
   struct dir_entry e;
 
-  if (dir != NULL && name != NULL && lookup (dir, name, &e, NULL) && DIR_CHECK)
+  *inode = NULL;
+  if (dir == NULL || name == NULL)
+    return false;
+
+  lock_acquire (&dir->inode->dir_lock);
+  if (lookup (dir, name, &e, NULL) && DIR_CHECK)
     *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  lock_release (&dir->inode->dir_lock);
 
   return *inode != NULL && DIR_CHECK;
 }
@@ -182,7 +185,6 @@ dir_path_lookup (const char *path_str)
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is_dir)
 {
-  lock_acquire (&dir->dir_lock);
   struct dir_entry e;
   off_t ofs;
   bool success = false;
@@ -194,8 +196,10 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  lock_acquire (&dir->inode->dir_lock);
+
+  /* Check that DIR still exists and that NAME is not in use. */
+  if (dir->inode->removed || lookup (dir, name, NULL, NULL))
     goto done;
 
   /* Set OFS to offset of free slot.
@@ -219,27 +223,31 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
  done:
-  lock_release (&dir->dir_lock);
+  lock_release (&dir->inode->dir_lock);
   return success;
 }
 
 /* Removes any entry for NAME in DIR. If NAME is a directory,
-   remove it if it's empty.
-   Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   remove it only if it's empty, not open as a file descriptor and
+   not the working directory of any process.
+   Returns true if successful, false on failure.
+   A directory's lock is taken before that of any directory in it,
+   so a directory being removed is locked too: nothing can be added
+   to it or start using it until it is marked removed. */
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
-  lock_acquire (&dir->dir_lock);
   struct dir_entry e;
   struct inode *inode = NULL;
-  struct dir *dir_to_remove = NULL;
+  struct dir child;
   bool success = false;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  lock_acquire (&dir->inode->dir_lock);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -249,27 +257,34 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
-  /* Remove directory only if it's empty */
   if (e.is_dir)
-  {
-    dir_to_remove = dir_open (inode);
-    if (!dir_is_empty (dir_to_remove))
-      goto done;
-  }
-
-  /* Erase directory entry. */
-  e.in_use = false;
-  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
-    goto done;
+    lock_acquire (&inode->dir_lock);
+
+  /* Remove directory only if it's empty and unused */
+  child.inode = inode;
+  child.pos = 0;
+  if (!e.is_dir
+      || (dir_is_empty (&child) && inode->open_fd_cnt == 0
+          && inode->cwd_cnt == 0))
+    {
+      /* Erase directory entry. */
+      e.in_use = false;
+      if (inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e) 
+        {
+          /* Remove inode, once the entry is gone on disk too, since
+             its sectors may be reused as soon as it is closed. */
+          inode_sync_at (dir->inode, sizeof e, ofs);
+          inode_remove (inode);
+          success = true;
+        }
+    }
 
-  /* Remove inode. */
-  inode_remove (inode);
-  success = true;
+  if (e.is_dir)
+    lock_release (&inode->dir_lock);
 
  done:
-  dir_close (dir_to_remove);
   inode_close (inode);
-  lock_release (&dir->dir_lock);
+  lock_release (&dir->inode->dir_lock);
   return success;
 }
 
@@ -280,17 +295,21 @@ bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
+  bool found = false;
 
+  lock_acquire (&dir->inode->dir_lock);
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
       dir->pos += sizeof e;
       if (e.in_use)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
+          found = true;
+          break;
         } 
     }
-  return false;
+  lock_release (&dir->inode->dir_lock);
+  return found;
 }
 
 bool
@@ -411,6 +430,8 @@ path_is_dir (const char *path_str)
   return false;
 }
 
+/* Returns whether DIR has no entries.  Call with DIR's inode's
+   dir_lock held. */
 bool
 dir_is_empty (struct dir *dir)
 {
@@ -13,13 +13,12 @@
    retained, but much longer full path names must be allowed. */
 #define NAME_MAX 63
 #define DIR_PATH_MAX 600
-#define DIR_INITIAL_SIZE 10
+#define DIR_INITIAL_SIZE (INODE_INLINE_MAX / sizeof (struct dir_entry)) /* Fits inline */
 
 /* An open directory. */
 struct dir 
   {
     struct inode *inode;                /* Backing store. */
-    struct lock dir_lock;               /* Used to synch dir modifications */
     off_t pos;                          /* Current position. */
   };
 
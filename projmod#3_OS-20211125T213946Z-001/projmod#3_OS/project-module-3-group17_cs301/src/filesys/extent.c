@@ -0,0 +1,567 @@
+#include "filesys/extent.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/inode.h"
+#include "filesys/cache.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+
+/* Extent trees.
+
+   An extent-format inode maps its file sectors to disk sectors
+   with extents, runs of sectors that are consecutive both in the
+   file and on disk.  Up to INODE_EXTENTS of them fit in the inode
+   itself.  Past that, the inode holds the root of a B+tree, in the
+   style of ext4: leaves are sectors full of extents, interior
+   nodes are sectors full of children, and the inode's extent_depth
+   is the number of levels below it.  A contiguous file needs a
+   single extent however large it is, and a lookup reads at most
+   extent_depth sectors, most often none thanks to the copy of the
+   last leaf kept with the inode.
+
+   Nodes are split when they fill up but never merged: a file only
+   loses sectors when it is closed with some reserved past its end,
+   or removed. */
+
+#define EXTENT_NODE_MAGIC 0x45585452    /* "EXTR" */
+#define NODE_EXTENTS 41                 /* Extents in a leaf. */
+#define NODE_CHILDREN 62                /* Children of an interior node. */
+#define EXTENT_MAX_DEPTH 4              /* Enough for any disk Pintos uses. */
+
+/* An extent tree node below the inode.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_node
+  {
+    uint32_t magic;                     /* EXTENT_NODE_MAGIC. */
+    uint32_t cnt;                       /* Entries in use. */
+    uint32_t depth;                     /* Levels below this one, 0 in leaves. */
+    union
+      {
+        struct extent extents[NODE_EXTENTS];
+        struct extent_index children[NODE_CHILDREN];
+      }
+    e;
+    uint32_t unused;                    /* Not used. */
+  };
+
+/* Copy of the leaf that the last lookup of a deeper tree reached,
+   which maps all of the file's sectors in [LO, HI) that are mapped
+   at all. */
+struct extent_cache
+  {
+    block_sector_t lo, hi;              /* Empty range if not valid. */
+    struct extent_node leaf;
+  };
+
+static void read_node (block_sector_t, struct extent_node *);
+static void write_node (block_sector_t, struct extent_node *);
+static bool new_node (block_sector_t goal, block_sector_t *sectorp);
+static void cache_drop (struct inode *);
+
+/* Returns the number of the CNT EXTENTS that start at or before
+   file sector IDX. */
+static size_t
+extents_before (const struct extent *extents, size_t cnt, block_sector_t idx)
+{
+  size_t lo = 0, hi = cnt;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (extents[mid].logical <= idx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+/* Returns the number of the CNT CHILDREN that start at or before
+   file sector IDX. */
+static size_t
+children_before (const struct extent_index *children, size_t cnt,
+                 block_sector_t idx)
+{
+  size_t lo = 0, hi = cnt;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (children[mid].logical <= idx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+/* Returns the child of the CNT CHILDREN whose subtree holds file
+   sector IDX: the last that starts at or before it, or the first
+   if none does. */
+static size_t
+child_for (const struct extent_index *children, size_t cnt,
+           block_sector_t idx)
+{
+  size_t i = children_before (children, cnt, idx);
+  return i > 0 ? i - 1 : 0;
+}
+
+/* Returns the disk sector that the CNT EXTENTS map file sector IDX
+   to, or SECTOR_ERROR if none of them does. */
+static block_sector_t
+leaf_lookup (const struct extent *extents, size_t cnt, block_sector_t idx)
+{
+  size_t i = extents_before (extents, cnt, idx);
+
+  if (i > 0 && idx < extents[i - 1].logical + extents[i - 1].length)
+    return extents[i - 1].start + (idx - extents[i - 1].logical);
+  return SECTOR_ERROR;
+}
+
+/* Returns the disk sector that holds file sector IDX of INODE, an
+   extent-format inode, or SECTOR_ERROR if no extent maps it.
+   Call with INODE's meta_lock held. */
+block_sector_t
+extent_lookup (struct inode *inode, block_sector_t idx)
+{
+  struct inode_disk *data = inode->data;
+  struct extent_cache *c;
+  block_sector_t sector;
+
+  if (data->extent_depth == 0)
+    return leaf_lookup (data->index.extents, data->extent_cnt, idx);
+
+  lock_acquire (&inode->map_lock);
+  c = inode->extent_cache;
+  if (c == NULL)
+    {
+      c = inode->extent_cache = malloc (sizeof *c);
+      if (c == NULL)
+        PANIC ("No memory left");
+      c->lo = c->hi = 0;
+    }
+
+  if (idx < c->lo || idx >= c->hi)
+    { /* Walk down from the root */
+      const struct extent_index *children = data->index.children;
+      size_t cnt = data->extent_cnt;
+      block_sector_t lo = 0, hi = (block_sector_t) -1;
+
+      for (;;)
+        {
+          size_t i = child_for (children, cnt, idx);
+
+          if (i > 0)
+            lo = children[i].logical;
+          if (i + 1 < cnt)
+            hi = children[i + 1].logical;
+          read_node (children[i].child, &c->leaf);
+          if (c->leaf.depth == 0)
+            break;
+          children = c->leaf.e.children;
+          cnt = c->leaf.cnt;
+        }
+      c->lo = lo;
+      c->hi = hi;
+    }
+  sector = leaf_lookup (c->leaf.e.extents, c->leaf.cnt, idx);
+  lock_release (&inode->map_lock);
+  return sector;
+}
+
+/* Returns the file sector just past the last one that the extents
+   of DATA, an extent-format inode, map, or 0 if they map none. */
+block_sector_t
+extent_end (const struct inode_disk *data)
+{
+  struct extent_node *node;
+  struct extent last;
+  block_sector_t sector;
+
+  if (data->extent_cnt == 0)
+    return 0;
+  if (data->extent_depth == 0)
+    {
+      last = data->index.extents[data->extent_cnt - 1];
+      return last.logical + last.length;
+    }
+
+  node = malloc (sizeof *node);
+  if (node == NULL)
+    PANIC ("No memory left");
+  sector = data->index.children[data->extent_cnt - 1].child;
+  for (;;)
+    {
+      read_node (sector, node);
+      ASSERT (node->cnt > 0);
+      if (node->depth == 0)
+        break;
+      sector = node->e.children[node->cnt - 1].child;
+    }
+  last = node->e.extents[node->cnt - 1];
+  free (node);
+  return last.logical + last.length;
+}
+
+/* Adds extent X to the *CNT EXTENTS, in order, by extending the
+   one before it if X follows it both in the file and on disk.
+   Returns false, changing nothing, if X needs a new entry and
+   there are already CAP. */
+static bool
+leaf_add (struct extent *extents, uint32_t *cnt, size_t cap,
+          const struct extent *x)
+{
+  size_t i = extents_before (extents, *cnt, x->logical);
+
+  if (i > 0)
+    {
+      struct extent *prev = &extents[i - 1];
+      if (prev->logical + prev->length == x->logical
+          && prev->start + prev->length == x->start)
+        {
+          prev->length += x->length;
+          return true;
+        }
+    }
+
+  if (*cnt >= cap)
+    return false;
+  memmove (&extents[i + 1], &extents[i], (*cnt - i) * sizeof *extents);
+  extents[i] = *x;
+  (*cnt)++;
+  return true;
+}
+
+/* Adds child X to the *CNT CHILDREN, in order.  Returns false,
+   changing nothing, if there are already CAP. */
+static bool
+index_add (struct extent_index *children, uint32_t *cnt, size_t cap,
+           const struct extent_index *x)
+{
+  size_t i = children_before (children, *cnt, x->logical);
+
+  if (*cnt >= cap)
+    return false;
+  memmove (&children[i + 1], &children[i], (*cnt - i) * sizeof *children);
+  children[i] = *x;
+  (*cnt)++;
+  return true;
+}
+
+/* Splits full NODE, stored at SECTOR, in two and adds X, an
+   extent if NODE is a leaf or a child otherwise, to the proper
+   half.  Stores the new right half into *SIBLING, for the parent.
+   Returns false if there is no sector for the new node. */
+static bool
+split_node (block_sector_t sector, struct extent_node *node, const void *x,
+            struct extent_index *sibling)
+{
+  struct extent_node *right;
+  size_t half = node->cnt / 2;
+  bool leaf = node->depth == 0;
+  block_sector_t first;
+
+  right = malloc (sizeof *right);
+  if (right == NULL)
+    return false;
+  if (!new_node (sector + 1, &sibling->child))
+    {
+      free (right);
+      return false;
+    }
+
+  right->magic = EXTENT_NODE_MAGIC;
+  right->depth = node->depth;
+  right->cnt = node->cnt - half;
+  right->unused = 0;
+  if (leaf)
+    memcpy (right->e.extents, node->e.extents + half,
+            right->cnt * sizeof *right->e.extents);
+  else
+    memcpy (right->e.children, node->e.children + half,
+            right->cnt * sizeof *right->e.children);
+  node->cnt = half;
+
+  first = leaf ? right->e.extents[0].logical : right->e.children[0].logical;
+  if (leaf)
+    {
+      const struct extent *e = x;
+      struct extent_node *half_node = e->logical >= first ? right : node;
+      leaf_add (half_node->e.extents, &half_node->cnt, NODE_EXTENTS, e);
+    }
+  else
+    {
+      const struct extent_index *c = x;
+      struct extent_node *half_node = c->logical >= first ? right : node;
+      index_add (half_node->e.children, &half_node->cnt, NODE_CHILDREN, c);
+    }
+
+  sibling->logical = first;
+  write_node (sector, node);
+  write_node (sibling->child, right);
+  free (right);
+  return true;
+}
+
+/* Moves the entries of INODE's full root into a new node below it,
+   together with X, an extent if the root holds extents or a child
+   otherwise, making the tree one level deeper.  Returns false if
+   there is no sector for the new node. */
+static bool
+grow_root (struct inode *inode, const void *x)
+{
+  struct inode_disk *data = inode->data;
+  struct extent_node *node;
+  block_sector_t sector;
+
+  if (data->extent_depth + 1 > EXTENT_MAX_DEPTH)
+    return false;
+  node = malloc (sizeof *node);
+  if (node == NULL)
+    return false;
+  if (!new_node (inode->sector + 1, &sector))
+    {
+      free (node);
+      return false;
+    }
+
+  node->magic = EXTENT_NODE_MAGIC;
+  node->depth = data->extent_depth;
+  node->cnt = data->extent_cnt;
+  node->unused = 0;
+  if (node->depth == 0)
+    {
+      memcpy (node->e.extents, data->index.extents,
+              node->cnt * sizeof *node->e.extents);
+      leaf_add (node->e.extents, &node->cnt, NODE_EXTENTS, x);
+    }
+  else
+    {
+      memcpy (node->e.children, data->index.children,
+              node->cnt * sizeof *node->e.children);
+      index_add (node->e.children, &node->cnt, NODE_CHILDREN, x);
+    }
+  write_node (sector, node);
+  free (node);
+
+  data->index.children[0].logical = 0;
+  data->index.children[0].child = sector;
+  data->extent_cnt = 1;
+  data->extent_depth++;
+  return true;
+}
+
+/* Adds extent X to INODE's extent tree, which must not map any of
+   its sectors yet, splitting nodes on the way up as they fill.
+   Returns false if a new node is needed and cannot be allocated,
+   in which case nothing maps X.  Marks INODE's data dirty, since
+   its root may change.  Call with INODE's meta_lock held for
+   writing. */
+bool
+extent_insert (struct inode *inode, const struct extent *x)
+{
+  struct inode_disk *data = inode->data;
+  block_sector_t path[EXTENT_MAX_DEPTH];
+  const struct extent_index *children;
+  struct extent_index carry;
+  struct extent_node *node;
+  size_t cnt, depth = data->extent_depth, d;
+  bool success = false;
+
+  cache_drop (inode);
+  inode->data_dirty = true;
+  if (depth == 0)
+    return (leaf_add (data->index.extents, &data->extent_cnt, INODE_EXTENTS, x)
+            || grow_root (inode, x));
+
+  node = malloc (sizeof *node);
+  if (node == NULL)
+    return false;
+
+  /* Find the nodes from below the root down to the leaf. */
+  children = data->index.children;
+  cnt = data->extent_cnt;
+  for (d = depth; d-- > 0; )
+    {
+      path[d] = children[child_for (children, cnt, x->logical)].child;
+      if (d == 0)
+        break;
+      read_node (path[d], node);
+      children = node->e.children;
+      cnt = node->cnt;
+    }
+
+  /* Add X to the leaf, then each new right half to the parent of
+     the node that split, for as long as nodes split. */
+  read_node (path[0], node);
+  if (leaf_add (node->e.extents, &node->cnt, NODE_EXTENTS, x))
+    {
+      write_node (path[0], node);
+      success = true;
+      goto done;
+    }
+  if (!split_node (path[0], node, x, &carry))
+    goto done;
+
+  for (d = 1; d < depth; d++)
+    {
+      struct extent_index sibling;
+
+      read_node (path[d], node);
+      if (index_add (node->e.children, &node->cnt, NODE_CHILDREN, &carry))
+        {
+          write_node (path[d], node);
+          success = true;
+          goto done;
+        }
+      if (!split_node (path[d], node, &carry, &sibling))
+        goto done;
+      carry = sibling;
+    }
+
+  success = (index_add (data->index.children, &data->extent_cnt,
+                        INODE_EXTENT_CHILDREN, &carry)
+             || grow_root (inode, &carry));
+
+ done:
+  free (node);
+  return success;
+}
+
+/* Gives back the sectors that the *CNT EXTENTS map from file
+   sector KEEP on, dropping the extents that become empty. */
+static void
+leaf_trim (struct extent *extents, uint32_t *cnt, block_sector_t keep)
+{
+  while (*cnt > 0)
+    {
+      struct extent *e = &extents[*cnt - 1];
+
+      if (e->logical >= keep)
+        {
+          free_map_release (e->start, e->length);
+          (*cnt)--;
+        }
+      else
+        {
+          if (e->logical + e->length > keep)
+            {
+              block_sector_t cut = e->logical + e->length - keep;
+              free_map_release (e->start + e->length - cut, cut);
+              e->length -= cut;
+            }
+          break;
+        }
+    }
+}
+
+static void children_trim (struct extent_index *, uint32_t *cnt,
+                           block_sector_t keep);
+
+/* Gives back the sectors that the subtree at SECTOR maps from file
+   sector KEEP on, and the sector itself if nothing is left in it.
+   Returns true in that case. */
+static bool
+subtree_trim (block_sector_t sector, block_sector_t keep)
+{
+  struct extent_node *node = malloc (sizeof *node);
+  bool empty;
+
+  if (node == NULL)
+    PANIC ("No memory left");
+  read_node (sector, node);
+  if (node->depth == 0)
+    leaf_trim (node->e.extents, &node->cnt, keep);
+  else
+    children_trim (node->e.children, &node->cnt, keep);
+
+  empty = node->cnt == 0;
+  if (empty)
+    free_map_release (sector, 1);
+  else
+    {
+      /* It must stop pointing to what it gave back on disk first */
+      write_node (sector, node);
+      bc_sync (sector);
+    }
+  free (node);
+  return empty;
+}
+
+/* Gives back the sectors that the subtrees of the *CNT CHILDREN
+   map from file sector KEEP on, dropping the children that become
+   empty. */
+static void
+children_trim (struct extent_index *children, uint32_t *cnt,
+               block_sector_t keep)
+{
+  while (*cnt > 0)
+    {
+      struct extent_index *c = &children[*cnt - 1];
+
+      if (!subtree_trim (c->child, c->logical >= keep ? 0 : keep))
+        break;
+      (*cnt)--;
+    }
+}
+
+/* Gives back to the free map the sectors that INODE's extents map
+   from file sector KEEP on, and the tree nodes that no longer map
+   anything, and marks INODE's data dirty.  The nodes that remain
+   are written through to disk; the caller does the same for the
+   inode.  Call between free_map_release_begin() and
+   free_map_release_end(), with INODE's meta_lock held for writing
+   or with INODE closed by everyone. */
+void
+extent_trim (struct inode *inode, block_sector_t keep)
+{
+  struct inode_disk *data = inode->data;
+
+  cache_drop (inode);
+  inode->data_dirty = true;
+  if (data->extent_depth == 0)
+    leaf_trim (data->index.extents, &data->extent_cnt, keep);
+  else
+    {
+      children_trim (data->index.children, &data->extent_cnt, keep);
+      if (data->extent_cnt == 0)
+        data->extent_depth = 0;
+    }
+}
+
+/* Reads the tree node at SECTOR into NODE. */
+static void
+read_node (block_sector_t sector, struct extent_node *node)
+{
+  ASSERT (sizeof *node == BLOCK_SECTOR_SIZE);
+  bc_block_read (sector, node, 0, BLOCK_SECTOR_SIZE);
+  ASSERT (node->magic == EXTENT_NODE_MAGIC);
+}
+
+/* Writes NODE to SECTOR, once the free map is on disk: NODE may
+   already be reachable from the inode on disk. */
+static void
+write_node (block_sector_t sector, struct extent_node *node)
+{
+  free_map_flush ();
+  bc_block_write (sector, node, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Allocates a sector for a new tree node, as close to GOAL as
+   possible, and stores it into *SECTORP.  Returns false if the
+   disk is full. */
+static bool
+new_node (block_sector_t goal, block_sector_t *sectorp)
+{
+  return free_map_allocate_run (goal, 1, sectorp) == 1;
+}
+
+/* Forgets INODE's copy of a leaf, which is about to change. */
+static void
+cache_drop (struct inode *inode)
+{
+  lock_acquire (&inode->map_lock);
+  if (inode->extent_cache != NULL)
+    inode->extent_cache->lo = inode->extent_cache->hi = 0;
+  lock_release (&inode->map_lock);
+}
@@ -0,0 +1,16 @@
+#ifndef FILESYS_EXTENT_H
+#define FILESYS_EXTENT_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+struct inode;
+struct inode_disk;
+struct extent;
+
+block_sector_t extent_lookup (struct inode *, block_sector_t idx);
+block_sector_t extent_end (const struct inode_disk *);
+bool extent_insert (struct inode *, const struct extent *);
+void extent_trim (struct inode *, block_sector_t keep);
+
+#endif /* filesys/extent.h */
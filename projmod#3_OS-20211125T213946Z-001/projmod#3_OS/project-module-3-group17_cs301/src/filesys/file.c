@@ -15,6 +15,9 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra.next_pos = 0;
+      file->ra.queued_end = 0;
+      file->ra.window = 0;
       return file;
     }
   else
@@ -60,7 +63,8 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read = inode_read_at_ra (file->inode, buffer, size, file->pos,
+                                       &file->ra);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -73,7 +77,7 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  return inode_read_at_ra (file->inode, buffer, size, file_ofs, &file->ra);
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
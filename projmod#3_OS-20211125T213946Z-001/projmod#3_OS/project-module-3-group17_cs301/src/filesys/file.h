@@ -6,6 +6,14 @@
 
 struct inode;
 
+/* Sequential stream detection for read-ahead. */
+struct read_ahead
+  {
+    off_t next_pos;             /* Offset a sequential read would start at. */
+    off_t queued_end;           /* End of the region already queued for prefetch. */
+    unsigned window;            /* Prefetch window in sectors, 0 if not streaming. */
+  };
+
 /* An open file. */
 struct file 
   {
@@ -13,6 +21,7 @@ struct file
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
     bool memory_mapped;
+    struct read_ahead ra;       /* Read-ahead state of this opener. */
   };
 
 /* Opening and closing files. */
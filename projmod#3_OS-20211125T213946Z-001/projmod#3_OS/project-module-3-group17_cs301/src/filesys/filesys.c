@@ -37,6 +37,7 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  free_map_flush ();
   bc_flush_all();
   free_map_close ();
 }
@@ -120,7 +121,7 @@ do_format (void)
 {
   printf ("Formatting file system...");
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16, ROOT_DIR_SECTOR))
+  if (!dir_create (ROOT_DIR_SECTOR, DIR_INITIAL_SIZE, ROOT_DIR_SECTOR))
     PANIC ("root directory creation failed");
   free_map_close ();
   printf ("done.\n");
@@ -1,13 +1,36 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "filesys/cache.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Protects the bitmaps below. */
+static struct lock flush_lock;       /* Serializes writing the file. */
+
+/* Sectors of the free map file that hold changed bits, one bit
+   each.  Allocating and releasing only mark them here; they are
+   written by free_map_flush(). */
+static struct bitmap *dirty_sectors;
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Released sectors, still marked in use in FREE_MAP.  A sector may
+   only be marked free on disk once nothing on disk points to it,
+   so releases wait here until every thread that released sectors
+   has written the metadata that referred to them: see
+   free_map_release_begin().  Held shared by those threads and
+   exclusively to move the pending sectors into FREE_MAP. */
+static struct bitmap *pending_free;
+static size_t pending_cnt;
+static struct rwlock release_lock;
+
+static void mark_dirty (size_t start, size_t cnt);
+static void fold_pending (void);
 
 /* Initializes the free map. */
 void
@@ -18,36 +41,108 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  dirty_sectors = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                               BLOCK_SECTOR_SIZE));
+  if (dirty_sectors == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  pending_free = bitmap_create (block_size (fs_device));
+  if (pending_free == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
+  lock_init (&flush_lock);
+  rw_init (&release_lock);
+}
+
+/* Records that bits START through START + CNT (exclusive) of the
+   free map changed.  Call with free_map_lock held. */
+static void
+mark_dirty (size_t start, size_t cnt)
+{
+  size_t first = start / BITS_PER_SECTOR;
+  size_t last = (start + cnt - 1) / BITS_PER_SECTOR;
+
+  bitmap_set_multiple (dirty_sectors, first, last - first + 1, true);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
+  lock_acquire (&free_map_lock);
   block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-    {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
-    }
+  if (sector != BITMAP_ERROR)
+    mark_dirty (sector, cnt);
+  lock_release (&free_map_lock);
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates up to CNT consecutive sectors, as close to GOAL as
+   possible, and stores the first into *SECTORP.  Prefers, in this
+   order, the free sectors starting right at GOAL, the first run of
+   CNT free sectors at or after GOAL (wrapping around to the start
+   of the disk), and the first free sectors at or after GOAL
+   however few.  Returns the number of sectors allocated, or 0 if
+   the disk is full. */
+size_t
+free_map_allocate_run (block_sector_t goal, size_t cnt,
+                       block_sector_t *sectorp)
+{
+  size_t size = bitmap_size (free_map);
+  size_t start, got;
+
+  ASSERT (cnt > 0);
+  if (goal >= size)
+    goal = 0;
+
+  lock_acquire (&free_map_lock);
+  start = goal;
+  if (bitmap_test (free_map, start))
+    {
+      start = bitmap_scan (free_map, goal, cnt, false);
+      if (start == BITMAP_ERROR)
+        start = bitmap_scan (free_map, 0, cnt, false);
+      if (start == BITMAP_ERROR)
+        start = bitmap_scan (free_map, goal, 1, false);
+      if (start == BITMAP_ERROR)
+        start = bitmap_scan (free_map, 0, 1, false);
+      if (start == BITMAP_ERROR)
+        {
+          lock_release (&free_map_lock);
+          return 0;
+        }
+    }
+
+  for (got = 1; got < cnt && start + got < size; got++)
+    if (bitmap_test (free_map, start + got))
+      break;
+
+  bitmap_set_multiple (free_map, start, got, true);
+  mark_dirty (start, got);
+  lock_release (&free_map_lock);
+  *sectorp = start;
+  return got;
+}
+
+/* Makes CNT sectors starting at SECTOR available for use, once
+   the metadata that pointed to them is on disk.  Releasing sectors
+   that something on disk may point to takes bracketing with
+   free_map_release_begin() and free_map_release_end(); sectors
+   that were never referenced are made available by the next
+   free_map_release_end() of any thread. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  ASSERT (bitmap_none (pending_free, sector, cnt));
+  bitmap_set_multiple (pending_free, sector, cnt, true);
+  pending_cnt += cnt;
+  lock_release (&free_map_lock);
 
   while (cnt > 0)
   {
@@ -68,13 +163,104 @@ free_map_open (void)
     PANIC ("can't read free map");
 }
 
-/* Writes the free map to disk and closes the free map file. */
+/* Writes the free map to disk and closes the free map file.  The
+   rest of the file system must already be on disk, so pending
+   releases are made final first. */
 void
 free_map_close (void) 
 {
+  fold_pending ();
+  free_map_flush ();
   file_close (free_map_file);
 }
 
+/* Starts releasing sectors that something on disk may point to.
+   Until the matching free_map_release_end(), the caller releases
+   them with free_map_release() and writes through to disk, with
+   bc_sync() or inode_sync_at(), the inodes, tree nodes and
+   directory entries that stop pointing to them.  Must not be
+   nested, nor be called while allocating. */
+void
+free_map_release_begin (void)
+{
+  rw_read_acquire (&release_lock);
+}
+
+/* Ends what free_map_release_begin() started, and makes available
+   the sectors released by everyone who has ended. */
+void
+free_map_release_end (void)
+{
+  rw_read_release (&release_lock);
+  fold_pending ();
+}
+
+/* Moves the pending releases into the free map, once no thread is
+   between free_map_release_begin() and free_map_release_end(). */
+static void
+fold_pending (void)
+{
+  size_t i;
+
+  if (pending_cnt == 0)
+    return;
+
+  rw_write_acquire (&release_lock);
+  lock_acquire (&free_map_lock);
+  for (i = bitmap_scan (pending_free, 0, 1, true);
+       pending_cnt > 0 && i != BITMAP_ERROR;
+       i = bitmap_scan (pending_free, i + 1, 1, true))
+    {
+      bitmap_reset (pending_free, i);
+      bitmap_reset (free_map, i);
+      mark_dirty (i, 1);
+      pending_cnt--;
+    }
+  lock_release (&free_map_lock);
+  rw_write_release (&release_lock);
+}
+
+/* Writes the sectors of the free map file that hold changed bits
+   through to disk.  inode_flush_disk() calls this before it writes
+   an inode to the cache, and the extent tree before it writes a
+   node, so that the sectors they map are marked in use on disk
+   before anything on disk points to them.  Released sectors only
+   reach the map once nothing on disk points to them (see
+   free_map_release()), so writing the map early is always safe.
+
+   free_map_lock is only held to pick the next changed sector, not
+   across the I/O, so allocation goes on meanwhile: a bit changed
+   after the sector was picked marks it again for the next flush.
+   Writing the free map file flushes its own inode: that nested
+   call returns at once. */
+void
+free_map_flush (void)
+{
+  size_t i;
+
+  if (free_map_file == NULL || lock_held_by_current_thread (&flush_lock))
+    return;
+
+  lock_acquire (&flush_lock);
+  for (;;)
+    {
+      lock_acquire (&free_map_lock);
+      i = bitmap_scan (dirty_sectors, 0, 1, true);
+      if (i != BITMAP_ERROR)
+        bitmap_reset (dirty_sectors, i);
+      lock_release (&free_map_lock);
+      if (i == BITMAP_ERROR)
+        break;
+
+      if (!bitmap_write_bytes (free_map, free_map_file,
+                               i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+        PANIC ("can't write free map");
+      inode_sync_at (file_get_inode (free_map_file), BLOCK_SECTOR_SIZE,
+                     i * BLOCK_SECTOR_SIZE);
+    }
+  lock_release (&flush_lock);
+}
+
 /* Creates a new free map file on disk and writes the free map to
    it. */
 void
@@ -84,10 +270,14 @@ free_map_create (void)
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), FREE_MAP_SECTOR, false))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
+  /* Write bitmap to file.  The file starts out as a hole, so the
+     write allocates its sectors, marking them in the map after
+     some of it may have been written: flushing writes those parts
+     again. */
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  free_map_flush ();
 }
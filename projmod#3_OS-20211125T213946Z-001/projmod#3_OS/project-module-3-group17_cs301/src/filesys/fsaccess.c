@@ -10,12 +10,16 @@
 
 #define FIRST_VALID_FILE_DESCRIPTOR 2;
 
+/* File descriptors of all processes.  The file system locks
+   itself, so the lock only protects the list and fd_count; a
+   descriptor found in the list can only be closed by its owner. */
 static struct list open_files;
+static struct lock open_files_lock;
 
 void
 fsaccess_init (void)
 {
-  lock_init (&files_lock);
+  lock_init (&open_files_lock);
   list_init (&open_files);
   fd_count = FIRST_VALID_FILE_DESCRIPTOR;
 }
@@ -26,9 +30,7 @@ create_file(const char *filepath, unsigned length)
   bool result = false;
   if (is_valid_address_of_thread (thread_current (), filepath, false, 0) && strlen (filepath))
     {
-      lock_fs ();
       result = filesys_create(filepath, length);
-      unlock_fs ();
     }
   
   return result;
@@ -55,22 +57,28 @@ change_directory(const char *dirpath)
   if (dirpath == NULL)
     return false;
 
-  lock_fs ();
-
   if ((new_dir = dir_open (dir_path_lookup (dirpath))) == NULL)
-  {
-    unlock_fs ();
     return false;
-  }
+
+  /* dir_remove() checks cwd_cnt and marks the directory removed
+     under its lock, so count it under the same lock or not at all */
+  lock_acquire (&new_dir->inode->dir_lock);
+  if (new_dir->inode->removed)
+    {
+      lock_release (&new_dir->inode->dir_lock);
+      dir_close (new_dir);
+      return false;
+    }
+  new_dir->inode->cwd_cnt++;
+  lock_release (&new_dir->inode->dir_lock);
 
   old_dir = get_curr_working_dir ();
+  lock_acquire (&old_dir->inode->dir_lock);
   old_dir->inode->cwd_cnt--;
+  lock_release (&old_dir->inode->dir_lock);
   dir_close (old_dir);
-  new_dir->inode->cwd_cnt++;
   thread_current ()->curr_dir = new_dir;
 
-  unlock_fs ();
-
   return true;
 }
 
@@ -78,22 +86,11 @@ bool
 remove_file_or_dir(const char *path)
 {
   bool result = false;
+  /* Directories are only removed if empty, not open with a file
+     descriptor and not the cwd of any process: dir_remove() checks
+     that under the directory's lock */
   if (is_valid_address_of_thread (thread_current (), path, false, 0))
-    {    
-      if (path_is_dir (path))
-      { 
-      /* Remove directory only if it's empty and it's not open
-         with a file descriptor or a cwd of any process 
-         (it's enough to check that there are zero openers) */
-        struct dir *dir = dir_open (dir_path_lookup (path));
-        if (dir_is_empty (dir) && !is_dir_open_fd_global (dir) && !is_dir_cwd_global (dir))
-          result = filesys_remove (path);
-      }
-      else
-      {
-        result = filesys_remove (path);
-      }
-    }
+    result = filesys_remove (path);
 
   return result;
 }
@@ -101,17 +98,24 @@ remove_file_or_dir(const char *path)
 struct file_descriptor *
 get_file_descriptor (int fd_num)
 {
+  struct file_descriptor *found = NULL;
   struct list_elem *e;
+
+  lock_acquire (&open_files_lock);
   e = list_tail (&open_files);
   while ((e = list_prev (e)) != list_head (&open_files)) 
     {
       struct file_descriptor *fd;
       fd = list_entry (e, struct file_descriptor, elem);
       if (fd->fd_num == fd_num && fd->owner == thread_current()->tid)
-          return fd;
+        {
+          found = fd;
+          break;
+        }
     }
+  lock_release (&open_files_lock);
 
-  return NULL;
+  return found;
 }
 
 /* Open directory with file descriptor */
@@ -122,7 +126,6 @@ open_file_or_dir(const char *path)
   struct file_descriptor *fd = malloc(sizeof(struct file_descriptor));
   struct dir *dir = (void *)0x1;
   struct file *f = (void *)0x1;
-  lock_fs ();
 
   bool is_dir = path_is_dir (path);
   if (is_dir)
@@ -130,11 +133,32 @@ open_file_or_dir(const char *path)
   else
     f = filesys_open (path);
 
-  if(f == NULL || dir == NULL)
+  /* Count the descriptor under the directory's lock, as dir_remove()
+     checks open_fd_cnt and marks it removed under that lock */
+  if (is_dir && dir != NULL && fd != NULL)
+    {
+      lock_acquire (&dir->inode->dir_lock);
+      if (dir->inode->removed)
+        {
+          lock_release (&dir->inode->dir_lock);
+          dir_close (dir);
+          dir = NULL;
+        }
+      else
+        {
+          dir->inode->open_fd_cnt++;
+          lock_release (&dir->inode->dir_lock);
+        }
+    }
+
+  if(f == NULL || dir == NULL || fd == NULL)
   {
-    unlock_fs ();
     if(fd != NULL)
       free(fd);
+    if (is_dir && dir != NULL)
+      dir_close (dir);
+    else if (!is_dir && f != NULL)
+      file_close (f);
 
     return -1;
   }
@@ -144,7 +168,6 @@ open_file_or_dir(const char *path)
     {
       fd->open_file = NULL;
       fd->open_dir = dir;
-      dir->inode->open_fd_cnt++;
     }
     else
     {
@@ -152,13 +175,14 @@ open_file_or_dir(const char *path)
       fd->open_file = f;  
     }
 
-    fd->fd_num = fd_count;
     fd->owner = thread_current ()->tid;
     fd->is_dir = is_dir;
+    lock_acquire (&open_files_lock);
+    fd->fd_num = fd_count;
     list_push_front (&open_files, &fd->elem);
     fd_count ++;
+    lock_release (&open_files_lock);
 
-    unlock_fs ();
     return fd->fd_num;
   }
 }
@@ -167,11 +191,9 @@ int filelength_open_file (int fd_num)
 {
   int result = -1;
 
-  lock_fs ();
   struct file_descriptor *fd = get_file_descriptor (fd_num);
   if (fd != NULL)
     result = file_length (fd->open_file);
-  unlock_fs ();
 
   return result;
 }
@@ -187,7 +209,6 @@ read_open_file (int fd_num, void *buffer, unsigned length)
       char * end = start + length;
       char c;
 
-      lock_fs ();
       while(start < end && (c = input_getc()) != 0)
       {
         
@@ -195,7 +216,6 @@ read_open_file (int fd_num, void *buffer, unsigned length)
         start++;
         result++;
       }
-      unlock_fs (); 
 
       *start = 0;
     }
@@ -203,16 +223,12 @@ read_open_file (int fd_num, void *buffer, unsigned length)
     result = -1;
   else //it is an actual file descriptor
     {
-      lock_fs (); 
       struct file_descriptor *fd = get_file_descriptor (fd_num);
-      unlock_fs (); 
 
-      FS_IN;
       if (fd != NULL && !fd->is_dir)
         result = file_read (fd->open_file, buffer, length);
       else
         result = -1;
-      FS_OUT;
     }
 
   return result;
@@ -231,22 +247,16 @@ write_open_file (int fd_num, void *buffer, unsigned length)
       result = -1;
   else if (fd_num == STDOUT_FILENO)
     {
-      lock_fs (); 
       putbuf (buffer, length); //#TODO check for too long buffers, break them down.
-      unlock_fs (); 
     }
   else //it is an actual file descriptor
     {
-      lock_fs (); 
       struct file_descriptor *fd = get_file_descriptor (fd_num);
-      unlock_fs ();
 
-      FS_IN;
       if (fd != NULL && !fd->is_dir)
         result = file_write (fd->open_file, buffer, length);
       else
         result = -1;
-      FS_OUT;
     }
 
   return result;
@@ -257,11 +267,9 @@ write_open_file (int fd_num, void *buffer, unsigned length)
 void
 seek_open_file (int fd_num, unsigned position)
 {
-  lock_fs (); 
   struct file_descriptor *fd = get_file_descriptor (fd_num);
   if (fd != NULL)
     file_seek (fd->open_file, position);
-  unlock_fs ();
 }
 
 /* Returns the current position in FILE as a byte offset from the
@@ -272,11 +280,9 @@ tell_open_file (int fd_num)
 {
   int result = 0;
 
-  lock_fs ();
   struct file_descriptor *fd = get_file_descriptor (fd_num);
   if (fd != NULL)
     result = file_tell (fd->open_file);
-  unlock_fs ();
 
   return result;
 }
@@ -294,9 +300,7 @@ memory_map_file (int fd_num, void *start_page)
   struct file *f = fd->open_file;
   ASSERT (f != NULL);
 
-  lock_fs ();
   struct file *rf = file_reopen(f);
-  unlock_fs ();
 
   int map_id = pt_suppl_handle_mmap (rf, start_page);
   return map_id;
@@ -311,56 +315,63 @@ memory_unmap_file (int map_id)
   lock_release (&current->pt_suppl_lock);
 }
 
+/* Closes what FD refers to and frees it.  FD must not be in the
+   list of open files anymore. */
+static void
+close_file_descriptor (struct file_descriptor *fd)
+{
+  if (fd->is_dir)
+  {
+    lock_acquire (&fd->open_dir->inode->dir_lock);
+    fd->open_dir->inode->open_fd_cnt--;
+    lock_release (&fd->open_dir->inode->dir_lock);
+  }
+  else
+  {
+    file_close(fd->open_file);
+  }
+  free(fd);
+}
+
 void
 close_open_file_or_dir (int fd_num)
 {
-  lock_fs (); 
   struct file_descriptor *fd = get_file_descriptor (fd_num);
   if (fd != NULL && fd->owner == thread_current ()->tid)
   {
-    if (fd->is_dir)
-    {
-      fd->open_dir->inode->open_fd_cnt--;
-    }
-    else
-    {
-      file_close(fd->open_file);
-    }
-    
+    lock_acquire (&open_files_lock);
     list_remove (&fd->elem);      
-    free(fd);
+    lock_release (&open_files_lock);
+    close_file_descriptor (fd);
   }
-  unlock_fs ();
 }
 
 void 
 close_all_files_and_dir ()
 {
-  lock_fs ();
-
-  struct list_elem *e;
-  e = list_tail (&open_files);
-  while ((e = list_prev (e)) != list_head (&open_files)) 
+  struct list own;
+  struct list_elem *e, *next;
+
+  /* Take this process's descriptors out of the list, then close
+     them without holding the lock */
+  list_init (&own);
+  lock_acquire (&open_files_lock);
+  for (e = list_begin (&open_files); e != list_end (&open_files); e = next)
     {
       struct file_descriptor *fd;
       fd = list_entry (e, struct file_descriptor, elem);
+      next = list_next (e);
       if (fd->owner == thread_current ()->tid)
         {
-          if (fd->is_dir)
-          {
-            fd->open_dir->inode->open_fd_cnt--;
-          }
-          else
-          {
-            file_close(fd->open_file);
-          }
-          e = list_next(e);
-          list_remove (&fd->elem);      
-          free(fd);
+          list_remove (&fd->elem);
+          list_push_back (&own, &fd->elem);
         }
     }
+  lock_release (&open_files_lock);
 
-  unlock_fs ();
+  while (!list_empty (&own))
+    close_file_descriptor (list_entry (list_pop_front (&own),
+                                       struct file_descriptor, elem));
 
   unmap_all();
 }
@@ -403,26 +414,3 @@ fd_inode_number (int fd)
   else
     return -1;
 }
-
-bool is_dir_open_fd_global (struct dir *dir)
-{
-  ASSERT (dir != NULL);
-  return (dir->inode->open_fd_cnt > 0);
-}
-
-bool 
-is_dir_cwd_global (struct dir *dir)
-{
-  ASSERT (dir != NULL);
-  return (dir->inode->cwd_cnt > 0);
-}
-
-void lock_fs ()
-{
-  lock_acquire (&files_lock);
-}
-
-void unlock_fs()
-{
-  lock_release (&files_lock);
-}
\ No newline at end of file
@@ -4,12 +4,6 @@
 #include "filesys/file.h"
 #include "lib/string.h"
 
-#define FS_DEBUG //TODO comment to enable fine-grained synch on W/R
-
-/* Synchronizes accesses to file system */
-struct lock files_lock;
-
-
 unsigned int fd_count;
 
 /* Represents an open file. */
@@ -25,14 +19,6 @@ struct file_descriptor
 };
 
 
-#ifdef FS_DEBUG
-#define FS_IN lock_fs();
-#define FS_OUT unlock_fs();
-#else
-#define FS_IN 
-#define FS_OUT
-#endif
-
 void fsaccess_init (void);
 
 bool create_file(const char *file, unsigned length);
@@ -54,9 +40,4 @@ void close_all_files_and_dir(void);
 bool read_directory (int fd, char *name);
 bool is_directory (int fd);
 int fd_inode_number (int fd);
-bool is_dir_open_fd_global (struct dir *dir);
-bool is_dir_cwd_global (struct dir *dir);
-
-void lock_fs (void);
-void unlock_fs(void);
 #endif
\ No newline at end of file
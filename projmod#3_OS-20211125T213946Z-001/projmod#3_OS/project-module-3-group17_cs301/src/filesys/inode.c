@@ -1,13 +1,17 @@
 #include "filesys/inode.h"
 #include <list.h>
 #include <debug.h>
+#include <stddef.h>
 #include <round.h>
 #include <string.h>
 #include <stdio.h>
+#include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "filesys/cache.h"
+#include "filesys/extent.h"
 #include "threads/malloc.h"
+#include "threads/vaddr.h"
 
 //allocate block sector or normal sector
 #define CHECK_ALLOCATE_AND_GET_SECTOR(table, idx, is_index_block)\
@@ -27,8 +31,56 @@
     ret;\
 })
 
-static void inode_release_disk (struct inode *inode);
+/* Read-ahead window bounds, in sectors. */
+#define RA_MIN_WINDOW 2
+#define RA_MAX_WINDOW 64
+
+/* Reads and writes of at least a page into a kernel buffer, such
+   as a frame being paged in from or out to a file, move whole
+   sectors between the disk and the buffer without the cache.  User
+   buffers always go through the cache, since a page fault inside
+   the disk driver could not be serviced. */
+#define DIRECT_IO_MIN PGSIZE
+#define is_direct_io(BUF, SIZE) ((SIZE) >= DIRECT_IO_MIN && is_kernel_vaddr (BUF))
+
+/* Most sectors reserved past the end of a file that is being
+   appended to, so that the next appends extend the same extent.
+   What is left unused is given back when the file is closed. */
+#define PREALLOC_MAX 64
+
+/* Copies of the index blocks of an old-format inode, so that
+   mapping an offset in its indirect range reads the block through
+   the cache once instead of opening it as an inode every time.
+   Dropped whenever the inode grows. */
+#define INDEX_CACHE_SLOTS 4
+
+struct index_cache
+  {
+    struct
+      {
+        block_sector_t sector;          /* Index block, or SECTOR_ERROR. */
+        block_sector_t entries[INDEX_BLOCK_ENTRIES];
+      }
+    slots[INDEX_CACHE_SLOTS];
+    size_t next;                        /* Slot to replace next. */
+  };
+
 static void inode_load_disk (struct inode *inode);
+static void inode_flush_disk (struct inode *inode);
+static void set_lengths (struct inode *, off_t length,
+                         off_t logical_length);
+static void get_lengths (struct inode *, off_t *length,
+                         off_t *logical_length);
+static void inode_read_ahead (struct inode *inode, struct read_ahead *ra,
+                              off_t start, off_t end);
+static block_sector_t index_lookup (struct inode *, block_sector_t idx);
+static void index_cache_drop (struct inode *);
+static block_sector_t extent_map_write (struct inode *, off_t offset,
+                                        off_t size, bool *fresh);
+static bool inline_read (struct inode *, void *buffer, off_t size,
+                         off_t offset, off_t *bytes_read);
+static bool inline_write (struct inode *, const void *buffer, off_t size,
+                          off_t offset, off_t *bytes_written);
 
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
@@ -49,30 +101,57 @@ bytes_to_sectors (off_t size)
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns SECTOR_ERROR if INODE does not contain data for a byte at offset
-   POS. 
+   POS, or holds its data inline. 
    Remember to call this after having loaded the inode in memory.
    */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
   ASSERT (inode != NULL);
   block_sector_t sector = SECTOR_ERROR;
 
-  if (pos < inode->data->length)
-    sector = inode_pos_to_real_sector (inode, pos, false);
+  if (pos >= inode->data->length)
+    return SECTOR_ERROR;
+
+  if (inode->data->format == INODE_FORMAT_EXTENTS)
+    sector = extent_lookup (inode, pos / BLOCK_SECTOR_SIZE);
+  else if (inode->data->format == INODE_FORMAT_INDEX)
+    sector = index_lookup (inode, pos / BLOCK_SECTOR_SIZE);
 
   return sector;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes by sector, so that opening a single inode twice
+   returns the same `struct inode'.  The lock also protects every
+   inode's open_cnt and deny_write_cnt. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+
+static unsigned inode_hash (const struct hash_elem *, void *aux);
+static bool inode_less (const struct hash_elem *, const struct hash_elem *,
+                        void *aux);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("Open inode table allocation failed");
+  lock_init (&open_inodes_lock);
+}
+
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -84,9 +163,7 @@ bool
 inode_create (block_sector_t sector, off_t length, block_sector_t parent, bool is_index_block)
 {
   struct inode_disk *disk_inode = NULL;
-  struct inode *inode = NULL;
-  bool success = true;
-  block_sector_t start_block;
+  bool success = false;
 
   ASSERT (length >= 0);
 
@@ -97,6 +174,7 @@ inode_create (block_sector_t sector, off_t length, block_sector_t parent, bool i
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
+      success = true;
       if (is_index_block)
         {
           for (int i = 0; i < INDEX_BLOCK_ENTRIES; i++)
@@ -108,37 +186,22 @@ inode_create (block_sector_t sector, off_t length, block_sector_t parent, bool i
         }
       else
         {
-          // Nothing is allocated yet: allocate first sector to have a starting position
-          start_block = allocate_new_block (disk_inode->index.main_index, 0);
-          if(start_block == SECTOR_ERROR)
-            return false;
-          disk_inode->start = start_block;
-          // All other blocks are empty
-          for (int i = 1; i < INDEX_MAIN_ENTRIES; i++)
-            disk_inode->index.main_index[i] = SECTOR_ERROR;
-
-          // Set length based on the fact that the first block is allocated
-          if (length >= BLOCK_SECTOR_SIZE)
-            disk_inode->length = BLOCK_SECTOR_SIZE;
-          else
-            disk_inode->length = length;
-
+          // Small files live in the inode until they outgrow it.
+          // Others go in extents, allocated when first written:
+          // until then the file is a hole that reads as zeros
+          disk_inode->length = length;
           disk_inode->parent = parent; 
           disk_inode->is_index_block = (uint32_t)is_index_block;
           disk_inode->magic = INODE_MAGIC;
+          if (length <= (off_t) INODE_INLINE_MAX)
+            disk_inode->format = INODE_FORMAT_INLINE;
+          else
+            disk_inode->format = INODE_FORMAT_EXTENTS;
+          disk_inode->extent_cnt = 0;
+          disk_inode->extent_depth = 0;
 
           // Write block for inode
           bc_block_write (sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
-
-          // If bigger than one block, grow inode to desired initial size (Allocates non-contiguously)
-          if (length > BLOCK_SECTOR_SIZE)
-            {
-              inode = inode_open (sector);
-              inode_load_disk (inode);
-              success = inode_grow (inode, length, 0);
-              inode_release_disk (inode);
-              inode_close (inode);
-            }
         }
       free (disk_inode);
     }
@@ -151,40 +214,56 @@ inode_create (block_sector_t sector, off_t length, block_sector_t parent, bool i
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  key.sector = sector;
+  lock_acquire (&open_inodes_lock);
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      /* Holding a count keeps the closer from freeing it */
+      while (inode->closing)
+        cond_wait (&inode->closed, &open_inodes_lock);
+      lock_release (&open_inodes_lock);
+      return inode; 
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->open_fd_cnt = 0;
   inode->cwd_cnt = 0;
+  lock_init (&inode->dir_lock);
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->closing = false;
+  cond_init (&inode->closed);
   lock_init (&inode->inode_lock);
-  lock_init (&inode->inode_growth);
+  rw_init (&inode->meta_lock);
   DEBUG_LOCK_ID (&inode->inode_lock, 15043);
   inode->data = NULL; //Lazy loaded
-  inode->access_count = 0;
+  inode->data_dirty = false;
   inode->logical_length = -1;
+  seq_init (&inode->length_seq);
+  inode->preallocated = false;
+  inode->extent_cache = NULL;
+  lock_init (&inode->map_lock);
+  inode->index_cache = NULL;
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -193,7 +272,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -209,10 +292,7 @@ inode_get_parent (struct inode *inode)
 {
   ASSERT (inode != NULL);
   inode_load_disk (inode);
-  block_sector_t result = inode->data->parent;
-  inode_release_disk (inode);
-
-  return result;
+  return inode->data->parent;
 }
 
 /* Closes INODE and writes it to disk.
@@ -226,60 +306,125 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&open_inodes_lock);
+  if (--inode->open_cnt > 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
-      if (inode->removed) 
+      lock_release (&open_inodes_lock);
+      return;
+    }
+
+  /* Give back the sectors reserved past the end before anyone can
+     open the inode again and read its inode_disk from the cache.
+     That takes disk I/O, so it is done outside open_inodes_lock
+     with the inode marked closing: inode_open() of its sector
+     waits for it, and the inode stays open if it did. */
+  if (!inode->removed && inode->preallocated)
+    {
+      inode->closing = true;
+      lock_release (&open_inodes_lock);
+
+      inode_load_disk (inode);
+      free_map_release_begin ();
+      extent_trim (inode, bytes_to_sectors (inode->data->length));
+      inode->preallocated = false;
+      /* No one else can be using it: write it back directly */
+      bc_block_write (inode->sector, inode->data, 0, BLOCK_SECTOR_SIZE);
+      bc_sync (inode->sector);
+      inode->data_dirty = false;
+      free_map_release_end ();
+
+      lock_acquire (&open_inodes_lock);
+      inode->closing = false;
+      cond_broadcast (&inode->closed, &open_inodes_lock);
+      if (inode->open_cnt > 0)
         {
-          free_map_release (inode->sector, 1);
-          inode_load_disk (inode);
-          free_map_release (inode->data->start,
-                            bytes_to_sectors (inode->data->length)); 
-          inode_release_disk (inode);
+          lock_release (&open_inodes_lock);
+          return;
         }
+    }
+  hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
 
-      free (inode); 
+  /* Deallocate blocks if removed.  Its directory entry, the only
+     thing that pointed to it, is already on disk. */
+  if (inode->removed) 
+    {
+      free_map_release_begin ();
+      free_map_release (inode->sector, 1);
+      inode_load_disk (inode);
+      if (inode->data->format == INODE_FORMAT_EXTENTS)
+        extent_trim (inode, 0);
+      else if (inode->data->format == INODE_FORMAT_INDEX)
+        free_map_release (inode->data->start,
+                          bytes_to_sectors (inode->data->length)); 
+      inode->data_dirty = false; // Its sector is free now
+      free_map_release_end ();
     }
+
+  free (inode->data);
+  free (inode->index_cache);
+  free (inode->extent_cache);
+  free (inode); 
 }
 
-void
+/* Makes INODE's on-disk data available in INODE->data.  It is read
+   on first use and then stays in memory for as long as the inode is
+   open, so that only the first call takes inode_lock.  Fields that
+   change after creation are protected by meta_lock. */
+static void
 inode_load_disk (struct inode *inode)
 {
+  struct inode_disk *data;
+
+  if (inode->data != NULL)
+    return;
+
   lock_acquire (&inode->inode_lock);
-  ASSERT (inode->access_count != 0 || inode->data == NULL);
-  if (inode->access_count == 0) //Don't re-load
+  if (inode->data == NULL) //Don't re-load
     {
-      ASSERT (inode->data == NULL);
-      inode->data = malloc (sizeof (struct inode_disk));
-      if (inode->data == NULL) 
+      data = malloc (sizeof (struct inode_disk));
+      if (data == NULL) 
         PANIC ("No memory left");
-      bc_block_read (inode->sector, inode->data, 0, BLOCK_SECTOR_SIZE);
+      bc_block_read (inode->sector, data, 0, BLOCK_SECTOR_SIZE);
 
       if(inode->logical_length == -1)
-        inode->logical_length = inode->data->length;
+        inode->logical_length = data->length;
+
+      /* Sectors still reserved past the end, because the file was
+         not closed before a crash or shutdown, are given back like
+         those reserved while it is open. */
+      if (data->format == INODE_FORMAT_EXTENTS)
+        inode->preallocated = (extent_end (data)
+                               > bytes_to_sectors (data->length));
+
+      /* Fully read before other threads can see it */
+      barrier ();
+      inode->data = data;
     }
-
-  inode->access_count ++;
   lock_release (&inode->inode_lock);
 }
 
-void 
-inode_release_disk (struct inode *inode)
+/* Writes INODE->data back to the cache if it changed (see
+   data_dirty), once the free map is on disk.  Holds meta_lock for
+   reading, so that a write in progress is never copied half done;
+   inode_lock keeps two flushes from racing on data_dirty.  Call
+   without meta_lock. */
+static void
+inode_flush_disk (struct inode *inode)
 {
+  if (!inode->data_dirty)
+    return;
+
+  free_map_flush ();
+  rw_read_acquire (&inode->meta_lock);
   lock_acquire (&inode->inode_lock);
-  ASSERT (inode->access_count > 0);
-  ASSERT (inode->access_count != 0 || inode->data == NULL);
-  inode->access_count --; 
-  if (inode->access_count == 0)
+  if (inode->data_dirty)
     {
       bc_block_write (inode->sector, inode->data, 0, BLOCK_SECTOR_SIZE);
-      free(inode->data);
-      inode->data = NULL;
+      inode->data_dirty = false;
     }
   lock_release (&inode->inode_lock);
+  rw_read_release (&inode->meta_lock);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -296,6 +441,16 @@ inode_remove (struct inode *inode) //TODO maybe also remove all inodes pointed b
    than SIZE if an error occurs or end of file is reached. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
+{
+  return inode_read_at_ra (inode, buffer_, size, offset, NULL);
+}
+
+/* Like inode_read_at(), but also tracks the sequential stream
+   described by RA, if non-null, and asks the buffer cache to
+   prefetch the sectors that a sequential reader will need next. */
+off_t
+inode_read_at_ra (struct inode *inode, void *buffer_, off_t size,
+                  off_t offset, struct read_ahead *ra)
 {
   if (inode->logical_length == 0)
     return 0;
@@ -303,18 +458,29 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
   inode_load_disk (inode);
 
   uint8_t *buffer = (uint8_t *)buffer_;
+  off_t start = offset;
   off_t bytes_read = 0;
+  bool direct = is_direct_io (buffer, size);
+  off_t length, logical_length;
+
+  /* Reading at or past the end needs no lock */
+  get_lengths (inode, &length, &logical_length);
+  if (offset >= logical_length)
+    return 0;
+
+  if (inline_read (inode, buffer, size, offset, &bytes_read))
+    return bytes_read;
 
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
+      rw_read_acquire (&inode->meta_lock);
       block_sector_t sector_idx = byte_to_sector (inode, offset);
-      if (sector_idx == SECTOR_ERROR)
-        break;
+      off_t inode_left = inode->logical_length - offset;
+      rw_read_release (&inode->meta_lock);
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
-      off_t inode_left = inode->logical_length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -323,8 +489,13 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      bc_block_read (sector_idx, buffer + bytes_read, 
-                     sector_ofs, chunk_size);
+      if (sector_idx == SECTOR_ERROR) /* A hole */
+        memset (buffer + bytes_read, 0, chunk_size);
+      else if (direct && chunk_size == BLOCK_SECTOR_SIZE)
+        bc_direct_read (sector_idx, buffer + bytes_read);
+      else
+        bc_block_read (sector_idx, buffer + bytes_read, 
+                       sector_ofs, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
@@ -332,10 +503,61 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       bytes_read += chunk_size;
     }
 
-  inode_release_disk (inode);
+  if (ra != NULL && !direct)
+    inode_read_ahead (inode, ra, start, offset);
+
   return bytes_read;
 }
 
+/* Updates RA after a read of bytes [START, END) of INODE and
+   queues the sectors of the next window for the read-ahead daemon.
+   The window starts at RA_MIN_WINDOW sectors when a sequential run
+   is detected and doubles on every further sequential read, up to
+   RA_MAX_WINDOW; any other access resets it.  Only the part of the
+   window that has not been queued yet is requested.
+   Call with the inode loaded. */
+static void
+inode_read_ahead (struct inode *inode, struct read_ahead *ra,
+                  off_t start, off_t end)
+{
+  off_t pos, stop;
+
+  if (start != ra->next_pos)
+    { /* Not sequential */
+      ra->next_pos = end;
+      ra->queued_end = 0;
+      ra->window = 0;
+      return;
+    }
+
+  ra->next_pos = end;
+  if (ra->window == 0)
+    ra->window = RA_MIN_WINDOW;
+  else if (ra->window < RA_MAX_WINDOW)
+    ra->window *= 2;
+
+  pos = round_up_to_sector_boundary (end);
+  if (pos < ra->queued_end)
+    pos = ra->queued_end;
+
+  stop = round_up_to_sector_boundary (end) + sectors_to_bytes (ra->window);
+
+  rw_read_acquire (&inode->meta_lock);
+  if (stop > inode->logical_length)
+    stop = inode->logical_length;
+
+  for (; pos < stop; pos += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, pos);
+      if (sector != SECTOR_ERROR)
+        bc_request_read_ahead (sector);
+    }
+  rw_read_release (&inode->meta_lock);
+
+  if (pos > ra->queued_end)
+    ra->queued_end = pos;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs. */
@@ -347,27 +569,41 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 
   uint8_t *buffer = (uint8_t *)buffer_;
   off_t bytes_written = 0;
+  bool direct = is_direct_io (buffer, size);
+
+  if (inode->deny_write_cnt == 0
+      && inline_write (inode, buffer, size, offset, &bytes_written))
+    {
+      inode_flush_disk (inode);
+      return bytes_written;
+    }
 
-  bool is_growing;
+  bool is_growing, fresh;
   while (size > 0 && inode->deny_write_cnt == 0) 
     {
       is_growing = false;
+      fresh = false;
 
       /* Sector to write, starting byte offset within sector. */
+      rw_read_acquire (&inode->meta_lock);
       block_sector_t sector_idx = byte_to_sector (inode, offset);
+      rw_read_release (&inode->meta_lock);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      if (sector_idx == SECTOR_ERROR) // Read past end of inode
+      if (sector_idx == SECTOR_ERROR) // Past end of inode, or a hole
         {
-          lock_acquire (&inode->inode_lock);
-          is_growing = inode_grow (inode, size, offset);
-
-          if (!is_growing)
+          rw_write_acquire (&inode->meta_lock);
+          is_growing = true;
+          if (inode->data->format == INODE_FORMAT_EXTENTS)
+            sector_idx = extent_map_write (inode, offset, size, &fresh);
+          else if (inode_grow (inode, size, offset, &fresh))
+            sector_idx = byte_to_sector (inode, offset);
+
+          if (sector_idx == SECTOR_ERROR)
           {
-            lock_release (&inode->inode_lock);
+            rw_write_release (&inode->meta_lock);
             break;
           }
-          sector_idx = byte_to_sector (inode, offset);
         }
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -381,19 +617,25 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       {
         if (is_growing)
         {
-          inode->logical_length = inode->data->length;
-          lock_release (&inode->inode_lock);
+          set_lengths (inode, inode->data->length, inode->data->length);
+          rw_write_release (&inode->meta_lock);
         }
         break;
       }
 
-      bc_block_write (sector_idx, buffer + bytes_written,
-                      sector_ofs, chunk_size);
+      if (direct && chunk_size == BLOCK_SECTOR_SIZE)
+        bc_direct_write (sector_idx, buffer + bytes_written);
+      else if (fresh)
+        bc_block_write_new (sector_idx, buffer + bytes_written,
+                            sector_ofs, chunk_size);
+      else
+        bc_block_write (sector_idx, buffer + bytes_written,
+                        sector_ofs, chunk_size);
 
       if (is_growing)
       {
-        inode->logical_length = inode->data->length;
-        lock_release (&inode->inode_lock);
+        set_lengths (inode, inode->data->length, inode->data->length);
+        rw_write_release (&inode->meta_lock);
       }
 
       /* Advance. */
@@ -403,20 +645,52 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
     }
 
   ASSERT (!lock_held_by_current_thread (&inode->inode_lock));
-  ASSERT (!lock_held_by_current_thread (&inode->inode_growth)); 
+  ASSERT (!rw_write_held_by_current_thread (&inode->meta_lock));
 
-  inode_release_disk (inode);
+  inode_flush_disk (inode);
   return bytes_written;
 }
 
+/* Writes the sectors that hold the SIZE bytes of INODE at OFFSET
+   through to disk, waiting until they are there, rather than
+   leaving them to the write-back daemon.  Holes have nothing to
+   write. */
+void
+inode_sync_at (struct inode *inode, off_t size, off_t offset)
+{
+  off_t pos;
+
+  inode_load_disk (inode);
+  if (inode->data->format == INODE_FORMAT_INLINE)
+    {
+      inode_flush_disk (inode);
+      bc_sync (inode->sector);
+      return;
+    }
+
+  for (pos = offset - offset % BLOCK_SECTOR_SIZE; pos < offset + size;
+       pos += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector;
+
+      rw_read_acquire (&inode->meta_lock);
+      sector = byte_to_sector (inode, pos);
+      rw_read_release (&inode->meta_lock);
+      if (sector != SECTOR_ERROR)
+        bc_sync (sector);
+    }
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
 inode_deny_write (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  lock_acquire (&open_inodes_lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  lock_release (&open_inodes_lock);
 }
 
 /* Re-enables writes to INODE.
@@ -426,54 +700,88 @@ void
 inode_allow_write (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  lock_acquire (&open_inodes_lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  lock_release (&open_inodes_lock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
 off_t
 inode_length (struct inode *inode)
 {
+  off_t length, logical_length;
+
   inode_load_disk (inode);
-  off_t r = inode->data->length;
-  inode_release_disk (inode);
-  return r;
+  get_lengths (inode, &length, &logical_length);
+  return length;
 }
 
-// Assumes that the starting sector is already allocated
-// Assumes that the byte "inode->data->length" is in the last sector of the inode;
-bool inode_grow (struct inode *inode, off_t size, off_t offset)
+/* Sets INODE's length to LENGTH bytes, of which the first
+   LOGICAL_LENGTH are written and may be read.  Call with meta_lock
+   held for writing. */
+static void
+set_lengths (struct inode *inode, off_t length, off_t logical_length)
 {
-  ASSERT (size > 0);
-  block_sector_t sector_inode_relative;
-
-  if (offset + size > round_up_to_sector_boundary (inode->data->length))
-    { // Actually allocate more sectors
-      block_sector_t last_sector;  
-      off_t grow_len_bytes;
-      size_t grow_len;
-      if (inode->data->length <= BLOCK_SECTOR_SIZE)
-        last_sector = inode->data->start;
-      else
-        last_sector = inode->data->start + bytes_to_sectors (inode->data->length) - 1;
-      grow_len_bytes = offset + size - round_up_to_sector_boundary (inode->data->length);
-      grow_len = bytes_to_sectors (grow_len_bytes);
-      ASSERT (grow_len > 0);
+  seq_write_begin (&inode->length_seq);
+  inode->data->length = length;
+  inode->logical_length = logical_length;
+  seq_write_end (&inode->length_seq);
+}
 
-      for (size_t i = 1; i <= grow_len; i++)
-      {
-        sector_inode_relative = last_sector + i - inode->data->start;
-        if(inode_pos_to_real_sector (inode, sectors_to_bytes (sector_inode_relative), true) == SECTOR_ERROR)
-          return false;
-      }
+/* Stores INODE's length and how much of it may be read into
+   *LENGTH and *LOGICAL_LENGTH, as a consistent pair.  Unlike
+   meta_lock, this never waits for a growing writer's disk I/O. */
+static void
+get_lengths (struct inode *inode, off_t *length, off_t *logical_length)
+{
+  unsigned seq;
 
-      inode->data->length = inode->data->length + grow_len_bytes;
+  do
+    {
+      seq = seq_read_begin (&inode->length_seq);
+      *length = inode->data->length;
+      *logical_length = inode->logical_length;
     }
-  else
-    { // Just grow inode length value
-      inode->data->length = offset + size; 
+  while (seq_read_retry (&inode->length_seq, seq));
+}
+
+/* Grows INODE, an old-format inode, over the part of the SIZE
+   bytes at OFFSET that falls in OFFSET's sector, allocating the
+   sectors from the current end of the file up to that one.  The
+   format has no holes, so the sectors skipped over are zeroed; the
+   one holding OFFSET is not, and *FRESH is set if it was just
+   allocated, so that the caller writes it with bc_block_write_new().
+   Growing one sector at a time keeps readers, which go up to the
+   length, away from sectors not written yet.  Returns false if the
+   disk is full.  Call with meta_lock held for writing. */
+bool inode_grow (struct inode *inode, off_t size, off_t offset, bool *fresh)
+{
+  ASSERT (size > 0);
+  ASSERT (inode->data->format == INODE_FORMAT_INDEX);
+  block_sector_t old_end = bytes_to_sectors (inode->data->length);
+  block_sector_t idx = offset / BLOCK_SECTOR_SIZE;
+  off_t end = sectors_to_bytes (idx + 1);
+  block_sector_t sector;
+
+  inode->data_dirty = true;
+  index_cache_drop (inode);
+
+  for (block_sector_t i = old_end; i <= idx; i++)
+    {
+      sector = inode_pos_to_real_sector (inode, sectors_to_bytes (i), true);
+      if (sector == SECTOR_ERROR)
+        return false;
+      if (i < idx)
+        bc_block_zero (sector);
     }
+  *fresh = idx >= old_end;
+
+  if (offset + size < end)
+    end = offset + size;
+  if (end > inode->data->length)
+    set_lengths (inode, end, inode->logical_length);
 
   return true;
 }
@@ -514,7 +822,9 @@ block_sector_t inode_pos_to_real_sector (const struct inode *inode, off_t pos, b
 
       sector = CHECK_ALLOCATE_AND_GET_SECTOR (index_inode->data->index.block_index, inner_idx, false);
 
-      inode_release_disk (index_inode);
+      index_inode->data_dirty |= allocate_new;
+      inode_flush_disk (index_inode);
+      inode_close (index_inode);
     }
   else if (INODE_ACCESS_INDIRECT+1 <= sector_inode_relative &&
           sector_inode_relative <= INODE_ACCESS_MAX)
@@ -537,6 +847,7 @@ block_sector_t inode_pos_to_real_sector (const struct inode *inode, off_t pos, b
       
       //Find double index inode sector
       sector = CHECK_ALLOCATE_AND_GET_SECTOR (index_inode->data->index.block_index, inner_idx, true);
+      index_inode->data_dirty |= allocate_new;
 
       d_index_inode = inode_open (sector);
       ASSERT (d_index_inode != NULL);
@@ -550,26 +861,28 @@ block_sector_t inode_pos_to_real_sector (const struct inode *inode, off_t pos, b
 
       sector = CHECK_ALLOCATE_AND_GET_SECTOR (d_index_inode->data->index.block_index, d_inner_idx, false);
 
-      inode_release_disk (d_index_inode);
-      inode_release_disk (index_inode);
+      d_index_inode->data_dirty |= allocate_new;
+      inode_flush_disk (d_index_inode);
+      inode_flush_disk (index_inode);
+      inode_close (d_index_inode);
+      inode_close (index_inode);
     }
   else
-    {
-      PANIC ("OUT OF MEMORY: Trying to write to disk a file or folder greater than 8MB!");
+    { /* Past what the old format can index: files in it stop growing */
+      return SECTOR_ERROR;
     }
 
   return sector;
 }
 
-// Allocates block and sets entry in inode index
+// Allocates block and sets entry in inode index.  The block is
+// neither read nor written: the caller zeroes it or writes it whole
 block_sector_t allocate_new_block (block_sector_t *table, block_sector_t idx)
 {
-  static char zeros[BLOCK_SECTOR_SIZE];
   block_sector_t allocated_sector = 0;
   if (!free_map_allocate (1, &allocated_sector))
     return SECTOR_ERROR;
 
-  bc_block_write (allocated_sector, zeros, 0, BLOCK_SECTOR_SIZE);
   table[idx] = allocated_sector;
 
   return allocated_sector;
@@ -592,4 +905,322 @@ block_sector_t allocate_new_index_inode (block_sector_t *table, block_sector_t i
 off_t round_up_to_sector_boundary (off_t bytes)
 {
   return sectors_to_bytes (bytes_to_sectors (bytes));
-}
\ No newline at end of file
+}
+
+/* Returns the disk sector that holds file sector IDX of INODE, an
+   old-format inode, or SECTOR_ERROR if it has none.  Entries of
+   indirect index blocks come from INODE's index cache. */
+static block_sector_t
+index_lookup (struct inode *inode, block_sector_t idx)
+{
+  struct index_cache *c;
+  block_sector_t main_idx, inner_idx, table, sector;
+  size_t i;
+
+  if (idx <= INODE_ACCESS_DIRECT)
+    return inode->data->index.main_index[idx];
+  if (idx > INODE_ACCESS_INDIRECT)
+    return inode_pos_to_real_sector (inode, sectors_to_bytes (idx), false);
+
+  main_idx = DIV_ROUND_UP (idx - INODE_ACCESS_DIRECT, INDEX_BLOCK_ENTRIES)
+             + INODE_ACCESS_DIRECT;
+  table = inode->data->index.main_index[main_idx];
+  if (table == SECTOR_ERROR)
+    return SECTOR_ERROR;
+  inner_idx = idx - (DIRECT_BLOCKS
+                     + INDEX_BLOCK_ENTRIES * (main_idx - DIRECT_BLOCKS));
+
+  lock_acquire (&inode->map_lock);
+  c = inode->index_cache;
+  if (c == NULL)
+    {
+      c = inode->index_cache = malloc (sizeof *c);
+      if (c == NULL)
+        {
+          lock_release (&inode->map_lock);
+          return inode_pos_to_real_sector (inode, sectors_to_bytes (idx), false);
+        }
+      for (i = 0; i < INDEX_CACHE_SLOTS; i++)
+        c->slots[i].sector = SECTOR_ERROR;
+      c->next = 0;
+    }
+
+  for (i = 0; i < INDEX_CACHE_SLOTS; i++)
+    if (c->slots[i].sector == table)
+      break;
+  if (i == INDEX_CACHE_SLOTS)
+    {
+      i = c->next;
+      c->next = (c->next + 1) % INDEX_CACHE_SLOTS;
+      bc_block_read (table, c->slots[i].entries,
+                     offsetof (struct inode_disk, index.block_index),
+                     sizeof c->slots[i].entries);
+      c->slots[i].sector = table;
+    }
+  sector = c->slots[i].entries[inner_idx];
+  lock_release (&inode->map_lock);
+  return sector;
+}
+
+/* Forgets the index blocks cached for INODE, whose index is about
+   to change. */
+static void
+index_cache_drop (struct inode *inode)
+{
+  size_t i;
+
+  lock_acquire (&inode->map_lock);
+  if (inode->index_cache != NULL)
+    for (i = 0; i < INDEX_CACHE_SLOTS; i++)
+      inode->index_cache->slots[i].sector = SECTOR_ERROR;
+  lock_release (&inode->map_lock);
+}
+
+/* Maps file sectors FROM up to END of INODE, none of which may be
+   mapped yet, to sectors newly taken from the free map, in runs as
+   long as possible that continue the file sector before FROM on
+   disk.  If PREALLOC is nonzero, the first run asks for that many
+   more sectors, to be kept for later growth.  Returns false if the
+   disk is full or the extent tree cannot grow any deeper; any
+   sectors allocated stay mapped. */
+static bool
+extent_allocate (struct inode *inode, block_sector_t from,
+                 block_sector_t end, block_sector_t prealloc)
+{
+  block_sector_t goal = inode->sector + 1;
+  size_t want = end - from + prealloc;
+
+  if (from > 0)
+    {
+      block_sector_t prev = extent_lookup (inode, from - 1);
+      if (prev != SECTOR_ERROR)
+        goal = prev + 1;
+    }
+
+  while (from < end)
+    {
+      struct extent e;
+      size_t got = free_map_allocate_run (goal, want, &e.start);
+
+      if (got == 0)
+        return false;
+      e.logical = from;
+      e.length = got;
+      if (!extent_insert (inode, &e))
+        {
+          free_map_release (e.start, got);
+          return false;
+        }
+      from += got;
+      goal = e.start + got;
+      want = end > from ? end - from : 0;
+    }
+  return true;
+}
+
+/* Prepares INODE, an extent-format inode, for a write of SIZE
+   bytes at OFFSET that byte_to_sector() could not map: OFFSET is
+   past the end of the file or in a hole.  Allocates the sector
+   that holds OFFSET if it has none and grows the file over the
+   part of the write that falls in it.  Sectors skipped over stay
+   holes, which read as zeros and take no disk space.
+
+   Sets *FRESH if none of the sector's old contents are part of the
+   file, so that the write need not read them: it was just
+   allocated, or was reserved past the end of the file and never
+   written.  The bytes of the last sector past the end of the file
+   are always zero, so growing over them needs nothing.
+
+   Returns the disk sector, or SECTOR_ERROR if the disk is full.
+   Call with meta_lock held for writing. */
+static block_sector_t
+extent_map_write (struct inode *inode, off_t offset, off_t size, bool *fresh)
+{
+  struct inode_disk *data = inode->data;
+  block_sector_t old_end = bytes_to_sectors (data->length);
+  block_sector_t idx = offset / BLOCK_SECTOR_SIZE;
+  off_t end = sectors_to_bytes (idx + 1);
+  block_sector_t sector;
+
+  /* Reserved sectors skipped over would become part of the file
+     with whatever they hold: give them back instead */
+  if (idx > old_end && inode->preallocated)
+    {
+      free_map_release_begin ();
+      extent_trim (inode, old_end);
+      inode->preallocated = false;
+      bc_block_write (inode->sector, data, 0, BLOCK_SECTOR_SIZE);
+      bc_sync (inode->sector);
+      free_map_release_end ();
+    }
+
+  sector = extent_lookup (inode, idx);
+  *fresh = idx >= old_end;
+  if (sector == SECTOR_ERROR)
+    {
+      if (idx >= old_end)
+        { /* Appending: allocate the rest of the write at once, plus
+             room to grow.  Whatever is not written by the time the
+             file is closed is given back. */
+          block_sector_t write_end = bytes_to_sectors (offset + size);
+          block_sector_t prealloc = write_end < PREALLOC_MAX
+                                    ? write_end : PREALLOC_MAX;
+
+          inode->preallocated = true;
+          if (!extent_allocate (inode, idx, write_end, prealloc))
+            return SECTOR_ERROR;
+        }
+      else if (!extent_allocate (inode, idx, idx + 1, 0))
+        return SECTOR_ERROR;
+      sector = extent_lookup (inode, idx);
+      *fresh = true;
+    }
+
+  if (offset + size < end)
+    end = offset + size;
+  if (end > data->length)
+    {
+      set_lengths (inode, end, inode->logical_length);
+      inode->data_dirty = true;
+    }
+  return sector;
+}
+
+/* Copies SIZE bytes between BUFFER and byte OFS of the data held
+   by DATA, an inline inode: into the inode if TO_INODE, out of it
+   otherwise.  The data fills the index table and then the unused
+   words after it. */
+static void
+inline_copy (struct inode_disk *data, off_t ofs, void *buffer, off_t size,
+             bool to_inode)
+{
+  uint8_t *buf = buffer;
+
+  ASSERT (ofs >= 0 && ofs + size <= (off_t) INODE_INLINE_MAX);
+  while (size > 0)
+    {
+      uint8_t *area;
+      off_t area_left, chunk;
+
+      if (ofs < (off_t) sizeof data->index)
+        {
+          area = (uint8_t *) &data->index + ofs;
+          area_left = sizeof data->index - ofs;
+        }
+      else
+        {
+          area = (uint8_t *) data->unused + (ofs - sizeof data->index);
+          area_left = INODE_INLINE_MAX - ofs;
+        }
+      chunk = size < area_left ? size : area_left;
+      if (to_inode)
+        memcpy (area, buf, chunk);
+      else
+        memcpy (buf, area, chunk);
+      buf += chunk;
+      ofs += chunk;
+      size -= chunk;
+    }
+}
+
+/* Reads like inode_read_at() if INODE holds its data inline, and
+   stores the number of bytes read in *BYTES_READ.  Returns false,
+   reading nothing, if it keeps its data in sectors. */
+static bool
+inline_read (struct inode *inode, void *buffer, off_t size, off_t offset,
+             off_t *bytes_read)
+{
+  bool is_inline;
+
+  if (inode->data->format != INODE_FORMAT_INLINE)
+    return false;
+
+  rw_read_acquire (&inode->meta_lock);
+  is_inline = inode->data->format == INODE_FORMAT_INLINE;
+  if (is_inline)
+    {
+      off_t inode_left = inode->logical_length - offset;
+
+      *bytes_read = size < inode_left ? size : inode_left;
+      if (*bytes_read > 0)
+        inline_copy (inode->data, offset, buffer, *bytes_read, false);
+      else
+        *bytes_read = 0;
+    }
+  rw_read_release (&inode->meta_lock);
+  return is_inline;
+}
+
+/* Moves the data of INODE, an inline inode, out to a sector of its
+   own and makes INODE an extent-format inode.  Returns false if the
+   disk is full or memory runs out, leaving INODE as it was.  Call
+   with meta_lock held for writing. */
+static bool
+inline_to_extents (struct inode *inode)
+{
+  struct inode_disk *data = inode->data;
+  off_t length = data->length;
+  uint8_t *copy = malloc (INODE_INLINE_MAX);
+
+  if (copy == NULL)
+    return false;
+  inline_copy (data, 0, copy, length, false);
+
+  memset (&data->index, 0, sizeof data->index);
+  memset (data->unused, 0, sizeof data->unused);
+  data->format = INODE_FORMAT_EXTENTS;
+  data->extent_cnt = 0;
+  data->extent_depth = 0;
+  if (length > 0)
+    {
+      if (!extent_allocate (inode, 0, 1, 0))
+        {
+          data->format = INODE_FORMAT_INLINE;
+          inline_copy (data, 0, copy, length, true);
+          free (copy);
+          return false;
+        }
+      bc_block_write_new (extent_lookup (inode, 0), copy, 0, length);
+    }
+  inode->data_dirty = true;
+  free (copy);
+  return true;
+}
+
+/* Writes like inode_write_at() if INODE holds its data inline and
+   the write fits there, and stores the number of bytes written in
+   *BYTES_WRITTEN.  A write that does not fit moves the data out to
+   a sector first.  Returns false, writing nothing, if INODE keeps
+   its data in sectors, then or afterwards. */
+static bool
+inline_write (struct inode *inode, const void *buffer, off_t size,
+              off_t offset, off_t *bytes_written)
+{
+  struct inode_disk *data = inode->data;
+  bool is_inline;
+
+  if (data->format != INODE_FORMAT_INLINE)
+    return false;
+
+  rw_write_acquire (&inode->meta_lock);
+  is_inline = data->format == INODE_FORMAT_INLINE;
+  if (is_inline && offset + size > (off_t) INODE_INLINE_MAX)
+    {
+      /* Outgrown: the caller writes to the new sector */
+      is_inline = !inline_to_extents (inode);
+      *bytes_written = 0;
+    }
+  else if (is_inline)
+    {
+      /* Bytes past the end are zero, so a gap needs nothing */
+      inline_copy (data, offset, (void *) buffer, size, true);
+      if (offset + size > data->length)
+        {
+          set_lengths (inode, offset + size, offset + size);
+        }
+      inode->data_dirty = true;
+      *bytes_written = size;
+    }
+  rw_write_release (&inode->meta_lock);
+  return is_inline;
+}
@@ -6,8 +6,12 @@
 #include "devices/block.h"
 #include "threads/synch.h"
 #include "lib/kernel/list.h"
+#include "lib/kernel/hash.h"
 
 struct bitmap;
+struct read_ahead;
+struct index_cache;
+struct extent_cache;
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
@@ -17,7 +21,7 @@ struct bitmap;
 #define METADATA_BLOCKS (1 + INDIRECT_BLOCKS + D_INDIRECT_BLOCKS * D_INDIRECT_BLOCKS)
 #define INDEX_MAIN_ENTRIES (DIRECT_BLOCKS + INDIRECT_BLOCKS + D_INDIRECT_BLOCKS)
 #define INDEX_BLOCK_ENTRIES 64
-#define UNUSED_SIZE (123-INDEX_MAIN_ENTRIES)
+#define UNUSED_SIZE (120-INDEX_MAIN_ENTRIES)
 #define SECTOR_ERROR (6666666)
 
 /* When accessing a sector number relative to an inode, each of these numbers 
@@ -31,10 +35,39 @@ struct bitmap;
 (D_INDIRECT_BLOCKS * INDEX_BLOCK_ENTRIES * INDEX_BLOCK_ENTRIES) \
 - METADATA_BLOCKS) // 16383
 
+/* How an inode maps file sectors to disk sectors. */
+#define INODE_FORMAT_INDEX 0    /* Per-sector main_index, as first written. */
+#define INODE_FORMAT_EXTENTS 1  /* Runs of sectors in an extent tree. */
+#define INODE_FORMAT_INLINE 2   /* Data in the inode itself: index, then unused. */
+
+/* LENGTH consecutive disk sectors starting at START, holding the
+   file's sectors from LOGICAL on. */
+struct extent
+  {
+    block_sector_t logical;             /* First file sector. */
+    block_sector_t start;               /* First disk sector. */
+    block_sector_t length;              /* Number of sectors. */
+  };
+
+/* Child of an extent tree node, which maps the file's sectors from
+   LOGICAL up to the next child's. */
+struct extent_index
+  {
+    block_sector_t logical;             /* First file sector. */
+    block_sector_t child;               /* Sector of the child node. */
+  };
+
+#define INODE_EXTENTS \
+(INDEX_MAIN_ENTRIES * sizeof (block_sector_t) / sizeof (struct extent)) // 26
+#define INODE_EXTENT_CHILDREN \
+(INDEX_MAIN_ENTRIES * sizeof (block_sector_t) / sizeof (struct extent_index)) // 39
+
 union index_table
   {
     block_sector_t main_index[INDEX_MAIN_ENTRIES];		/* Main index of next blocks */
     block_sector_t block_index[INDEX_BLOCK_ENTRIES];	/* Supplementary index if it is an index block */
+    struct extent extents[INODE_EXTENTS];         /* Extents, sorted by logical sector */
+    struct extent_index children[INODE_EXTENT_CHILDREN]; /* Root of a deeper extent tree */
   };
 
 /* On-disk inode.
@@ -47,24 +80,39 @@ struct inode_disk
   	union index_table index;							/* Main index or supplementary index */
     uint32_t is_index_block;							/* Is it a normal data block or an index block? */
     unsigned magic;                     	/* Magic number. */
-    uint32_t unused[UNUSED_SIZE];    			/* Not used. */
+    uint32_t format;                      /* INODE_FORMAT_*, 0 in old inodes. */
+    uint32_t extent_cnt;                  /* Extents or children in use. */
+    uint32_t extent_depth;                /* Extent tree levels below the inode. */
+    uint32_t unused[UNUSED_SIZE];    			/* Inline data past the index, else not used. */
   };
 
+/* Most bytes an inline inode holds. */
+#define INODE_INLINE_MAX \
+(sizeof (union index_table) + UNUSED_SIZE * sizeof (uint32_t)) // 480
+
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open inode table. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     int open_fd_cnt;					          /* Number of open fds on this dir. */
     int cwd_cnt;                        /* Number of processes that have this dir as cwd. */
+    struct lock dir_lock;               /* Directories: protects entries and the two counts above */
     bool removed;                       /* True if deleted, false otherwise. */
+    bool closing;                       /* Last close writing it back, see inode_close() */
+    struct condition closed;            /* Signaled on open_inodes_lock when CLOSING clears */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
-    struct inode_disk* data;            /* Inode content. */
-    struct lock inode_lock;             /* Used to synchronize file loading */
-    struct lock inode_growth;           /* Used to synchronize file growth */
-    int access_count;                   /* Number of threads currently using this inode */
+    struct inode_disk* data;            /* Inode content, loaded on first use. */
+    bool data_dirty;                    /* DATA changed since written to the cache */
+    struct lock inode_lock;             /* Serializes loading and writing back DATA */
+    struct rwlock meta_lock;            /* Exclusive to grow the file, shared to map offsets */
     off_t logical_length;               /* Physical size minus what still needs to be initialized */
+    struct seqlock length_seq;          /* Lets readers load DATA->length and LOGICAL_LENGTH without meta_lock */
+    bool preallocated;                  /* Extents reach past the end of the file */
+    struct lock map_lock;               /* Protects index_cache and extent_cache */
+    struct index_cache *index_cache;    /* Old format: copies of index blocks */
+    struct extent_cache *extent_cache;  /* Extent tree: copy of the last leaf used */
   };
 
 void inode_init (void);
@@ -76,11 +124,14 @@ block_sector_t inode_get_parent (struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+off_t inode_read_at_ra (struct inode *, void *, off_t size, off_t offset,
+                        struct read_ahead *);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+void inode_sync_at (struct inode *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (struct inode *);
-bool inode_grow (struct inode *inode, off_t size, off_t offset);
+bool inode_grow (struct inode *inode, off_t size, off_t offset, bool *fresh);
 block_sector_t inode_pos_to_real_sector (const struct inode *inode, off_t pos, bool allocate_new);
 block_sector_t allocate_new_block (block_sector_t *table, block_sector_t idx);
 block_sector_t allocate_new_index_inode (block_sector_t *table, block_sector_t idx);
@@ -0,0 +1,29 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+/* Buffer cache counters, as returned by the cache_stats() system
+   call.  Counts are totals since boot. */
+struct cache_stats
+  {
+    unsigned long long hits;            /* Lookups that found the sector. */
+    unsigned long long misses;          /* Lookups that had to load it. */
+    unsigned long long evictions;       /* Sectors replaced by another. */
+    unsigned long long writebacks;      /* Dirty sectors written back. */
+    unsigned long long sync_writebacks; /* ...of which on the eviction path. */
+    unsigned long long ra_requests;     /* Read-ahead sectors queued. */
+    unsigned long long ra_dropped;      /* ...dropped, queue full. */
+    unsigned long long ra_reads;        /* ...read into the cache. */
+    unsigned long long ra_used;         /* ...later hit by a real access. */
+    unsigned long long ra_wasted;       /* ...evicted before any access. */
+    unsigned long long direct_reads;    /* Sectors read around the cache. */
+    unsigned long long direct_writes;   /* Sectors written around the cache. */
+    unsigned long long lock_waits;      /* Cache lock acquisitions that waited. */
+    unsigned long long lock_wait_ticks; /* Timer ticks spent waiting. */
+    unsigned long long pages_grown;     /* Pages added to the cache. */
+    unsigned long long pages_shrunk;    /* Pages given back to palloc. */
+    unsigned sectors;                   /* Current size in sectors. */
+    unsigned max_sectors;               /* Size limit in sectors. */
+    unsigned dirty;                     /* Currently dirty sectors. */
+  };
+
+#endif /* lib/cache-stats.h */
@@ -358,6 +358,23 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes bytes OFS through OFS + SIZE (exclusive) of B's image in
+   FILE, as written by bitmap_write(), or as many of them as there
+   are.  Return true if successful, false otherwise. */
+bool
+bitmap_write_bytes (const struct bitmap *b, struct file *file,
+                    size_t ofs, size_t size)
+{
+  size_t file_size = byte_cnt (b->bit_cnt);
+
+  if (ofs >= file_size)
+    return true;
+  if (size > file_size - ofs)
+    size = file_size - ofs;
+  return (file_write_at (file, (const uint8_t *) b->bits + ofs, size, ofs)
+          == (off_t) size);
+}
 #endif /* FILESYS */
 
 /* Debugging. */
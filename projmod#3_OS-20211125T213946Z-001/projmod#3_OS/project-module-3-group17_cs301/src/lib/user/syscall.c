@@ -182,3 +182,9 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+cache_stats (struct cache_stats *st)
+{
+  return syscall1 (SYS_CACHESTATS, st);
+}
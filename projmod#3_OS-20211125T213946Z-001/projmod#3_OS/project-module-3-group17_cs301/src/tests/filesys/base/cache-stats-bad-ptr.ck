@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(cache-stats-bad-ptr) begin
+cache-stats-bad-ptr: exit(-1)
+EOF
+pass;
@@ -0,0 +1,41 @@
+/* Reads a file twice and checks with cache_stats() that the
+   second read is served from the buffer cache. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[2048];
+
+void
+test_main (void) 
+{
+  const char *file_name = "cached";
+  struct cache_stats before, after;
+  int fd;
+
+  memset (buf, 'c', sizeof buf);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf,
+         "write \"%s\"", file_name);
+
+  msg ("seek \"%s\" to start", file_name);
+  seek (fd, 0);
+  CHECK (read (fd, buf, sizeof buf) == sizeof buf,
+         "read \"%s\"", file_name);
+  CHECK (cache_stats (&before), "cache_stats");
+
+  msg ("seek \"%s\" to start", file_name);
+  seek (fd, 0);
+  CHECK (read (fd, buf, sizeof buf) == sizeof buf,
+         "read \"%s\" again", file_name);
+  CHECK (cache_stats (&after), "cache_stats");
+
+  if (after.hits <= before.hits)
+    fail ("hits went from %llu to %llu on the second read",
+          before.hits, after.hits);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-stats) begin
+(cache-stats) create "cached"
+(cache-stats) open "cached"
+(cache-stats) write "cached"
+(cache-stats) seek "cached" to start
+(cache-stats) read "cached"
+(cache-stats) cache_stats
+(cache-stats) seek "cached" to start
+(cache-stats) read "cached" again
+(cache-stats) cache_stats
+(cache-stats) close "cached"
+(cache-stats) end
+EOF
+pass;
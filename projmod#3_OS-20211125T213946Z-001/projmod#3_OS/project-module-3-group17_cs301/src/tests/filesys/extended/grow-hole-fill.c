@@ -0,0 +1,31 @@
+/* Tests that writing into a hole in the middle of a sparse file
+   is still there after the file is closed and opened again. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[10240];
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  char zero = 0;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("seek \"%s\" to end", file_name);
+  seek (fd, sizeof buf - 1);
+  CHECK (write (fd, &zero, 1) > 0, "write \"%s\"", file_name);
+
+  memset (buf + 2560, 'x', 512);
+  msg ("seek \"%s\" into hole", file_name);
+  seek (fd, 2560);
+  CHECK (write (fd, buf + 2560, 512) == 512, "write \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
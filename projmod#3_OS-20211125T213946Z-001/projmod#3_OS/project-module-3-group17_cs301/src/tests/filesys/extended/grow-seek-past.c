@@ -0,0 +1,28 @@
+/* Tests that reading past the end of a small file, far beyond
+   what fits in its inode, reads nothing. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[100];
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  char block[512];
+  int fd;
+
+  memset (buf, 'a', sizeof buf);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"%s\"", file_name);
+  msg ("seek \"%s\" past end", file_name);
+  seek (fd, 1000);
+  CHECK (read (fd, block, sizeof block) == 0, "read \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
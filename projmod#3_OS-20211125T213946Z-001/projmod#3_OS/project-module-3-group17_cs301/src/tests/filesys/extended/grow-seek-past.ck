@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-seek-past) begin
+(grow-seek-past) create "testfile"
+(grow-seek-past) open "testfile"
+(grow-seek-past) write "testfile"
+(grow-seek-past) seek "testfile" past end
+(grow-seek-past) read "testfile"
+(grow-seek-past) close "testfile"
+(grow-seek-past) open "testfile" for verification
+(grow-seek-past) verified contents of "testfile"
+(grow-seek-past) close "testfile"
+(grow-seek-past) end
+EOF
+pass;
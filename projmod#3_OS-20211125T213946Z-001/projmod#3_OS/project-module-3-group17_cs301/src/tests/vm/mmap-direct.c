@@ -0,0 +1,46 @@
+/* Writes a whole page of a file through a mapping and reads it
+   back through a new one, checking that both transfers bypass the
+   buffer cache. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define ACTUAL ((void *) 0x10000000)
+#define PAGE_SECTORS (4096 / 512)
+
+static char buf[4096];
+
+void
+test_main (void)
+{
+  struct cache_stats before, after;
+  int handle;
+  mapid_t map;
+
+  memset (buf, 'x', sizeof buf);
+  CHECK (create ("sample.dat", sizeof buf), "create \"sample.dat\"");
+  CHECK ((handle = open ("sample.dat")) > 1, "open \"sample.dat\"");
+
+  /* Write the page back on munmap. */
+  CHECK ((map = mmap (handle, ACTUAL)) != MAP_FAILED, "mmap \"sample.dat\"");
+  memcpy (ACTUAL, buf, sizeof buf);
+  CHECK (cache_stats (&before), "cache_stats");
+  munmap (map);
+  CHECK (cache_stats (&after), "cache_stats");
+  CHECK (after.direct_writes >= before.direct_writes + PAGE_SECTORS,
+         "munmap wrote around the cache");
+
+  /* Page it in again, from sectors the write took out of the
+     cache. */
+  CHECK ((map = mmap (handle, ACTUAL)) != MAP_FAILED, "mmap \"sample.dat\"");
+  CHECK (cache_stats (&before), "cache_stats");
+  CHECK (!memcmp (ACTUAL, buf, sizeof buf),
+         "compare mapped data against written data");
+  CHECK (cache_stats (&after), "cache_stats");
+  CHECK (after.direct_reads >= before.direct_reads + PAGE_SECTORS,
+         "page-in read around the cache");
+  munmap (map);
+  close (handle);
+}
@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(mmap-direct) begin
+(mmap-direct) create "sample.dat"
+(mmap-direct) open "sample.dat"
+(mmap-direct) mmap "sample.dat"
+(mmap-direct) cache_stats
+(mmap-direct) cache_stats
+(mmap-direct) munmap wrote around the cache
+(mmap-direct) mmap "sample.dat"
+(mmap-direct) cache_stats
+(mmap-direct) compare mapped data against written data
+(mmap-direct) cache_stats
+(mmap-direct) page-in read around the cache
+(mmap-direct) end
+EOF
+pass;
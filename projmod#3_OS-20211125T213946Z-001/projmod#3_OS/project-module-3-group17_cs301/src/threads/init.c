@@ -34,6 +34,10 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
+#include "devices/pci.h"
+#include "devices/virtio-blk.h"
+#include "devices/ahci.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #include "filesys/cache.h"
@@ -128,7 +132,11 @@ int kernel_main(void)
 
 #ifdef FILESYS
   /* Initialize file system. */
+  pci_init();
   ide_init();
+  ahci_init();
+  virtio_blk_init();
+  ramdisk_init();
   locate_block_devices();
 #ifdef VM
   swap_init();
@@ -256,6 +264,20 @@ static char **parse_options(char **argv)
       filesys_bdev_name = value;
     else if (!strcmp(name, "-scratch"))
       scratch_bdev_name = value;
+    else if (!strcmp(name, "-bc-policy"))
+    {
+      if (!bc_set_policy(value))
+        PANIC("unknown buffer cache policy `%s'", value != NULL ? value : "");
+    }
+    else if (!strcmp(name, "-bc-size"))
+      bc_set_max_sectors(atoi(value));
+    else if (!strcmp(name, "-ramdisk"))
+      ramdisk_set_size(atoi(value));
+    else if (!strcmp(name, "-io-sched"))
+    {
+      if (!block_set_scheduler(value))
+        PANIC("unknown I/O scheduler `%s'", value != NULL ? value : "");
+    }
 #ifdef VM
     else if (!strcmp(name, "-swap"))
       swap_bdev_name = value;
@@ -381,6 +403,10 @@ usage(void)
          "  -f                 Format file system device during startup.\n"
          "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
          "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+         "  -bc-policy=POLICY  Buffer cache replacement: 2q (default) or clock.\n"
+         "  -bc-size=SECTORS   Let the buffer cache grow up to SECTORS sectors.\n"
+         "  -io-sched=SCHED    Disk scheduler: deadline (default), look or fifo.\n"
+         "  -ramdisk=KB        Create RAM disk rd0 of KB kB, e.g. -filesys=rd0.\n"
 #ifdef VM
          "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
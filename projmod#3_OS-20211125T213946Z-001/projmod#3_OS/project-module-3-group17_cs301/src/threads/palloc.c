@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/loader.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -31,11 +32,17 @@ struct pool
     struct lock lock;                   /* Mutual exclusion. */
     struct bitmap *used_map;            /* Bitmap of free pages. */
     uint8_t *base;                      /* Base of pool. */
+    size_t free_cnt;                    /* Pages free in USED_MAP. */
   };
 
 /* Two pools: one for kernel data, one for user pages. */
 static struct pool kernel_pool, user_pool;
 
+/* Called when the kernel pool runs short, or null. */
+static palloc_reclaim_func *reclaim_func;
+
+static size_t palloc_reclaim (size_t page_cnt);
+static void adjust_free_cnt (struct pool *, size_t add, size_t sub);
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
@@ -66,7 +73,9 @@ palloc_init (size_t user_page_limit)
    otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
    then the pages are filled with zeros.  If too few pages are
    available, returns a null pointer, unless PAL_ASSERT is set in
-   FLAGS, in which case the kernel panics. */
+   FLAGS, in which case the kernel panics.  Before giving up on
+   the kernel pool, the reclaim function gets one chance to free
+   pages. */
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 {
@@ -81,8 +90,19 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
   page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
   lock_release (&pool->lock);
 
+  if (page_idx == BITMAP_ERROR && pool == &kernel_pool
+      && palloc_reclaim (page_cnt) > 0)
+    {
+      lock_acquire (&pool->lock);
+      page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+      lock_release (&pool->lock);
+    }
+
   if (page_idx != BITMAP_ERROR)
-    pages = pool->base + PGSIZE * page_idx;
+    {
+      adjust_free_cnt (pool, 0, page_cnt);
+      pages = pool->base + PGSIZE * page_idx;
+    }
   else
     pages = NULL;
 
@@ -139,6 +159,7 @@ palloc_free_multiple (void *pages, size_t page_cnt)
 
   ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
   bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  adjust_free_cnt (pool, page_cnt, 0);
 }
 
 /* Frees the page at PAGE. */
@@ -148,6 +169,44 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of free pages in the user pool if PAL_USER
+   is set in FLAGS, otherwise in the kernel pool. */
+size_t
+palloc_free_cnt (enum palloc_flags flags)
+{
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+
+  return pool->free_cnt;
+}
+
+/* Sets the function called to free kernel pages when the kernel
+   pool runs short. */
+void
+palloc_set_reclaim (palloc_reclaim_func *func)
+{
+  reclaim_func = func;
+}
+
+/* Asks the reclaim function to free up to PAGE_CNT kernel pages.
+   Returns the number of pages freed. */
+static size_t
+palloc_reclaim (size_t page_cnt)
+{
+  return reclaim_func != NULL ? reclaim_func (page_cnt) : 0;
+}
+
+/* Adds ADD to POOL's free page count and subtracts SUB.  Pages are
+   freed without the pool lock, even by a dying thread with
+   interrupts off, so the count is kept with interrupts off. */
+static void
+adjust_free_cnt (struct pool *pool, size_t add, size_t sub)
+{
+  enum intr_level old_level = intr_disable ();
+
+  pool->free_cnt = pool->free_cnt + add - sub;
+  intr_set_level (old_level);
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
@@ -167,6 +226,7 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
   lock_init (&p->lock);
   p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
   p->base = base + bm_pages * PGSIZE;
+  p->free_cnt = page_cnt;
 }
 
 /* Returns true if PAGE was allocated from POOL,
@@ -16,5 +16,11 @@ void *palloc_get_page (enum palloc_flags);
 void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
+size_t palloc_free_cnt (enum palloc_flags);
+
+/* Asks a cache to give back up to PAGE_CNT kernel pages, returning
+   how many it freed.  Must not block. */
+typedef size_t palloc_reclaim_func (size_t page_cnt);
+void palloc_set_reclaim (palloc_reclaim_func *);
 
 #endif /* threads/palloc.h */
@@ -350,3 +350,237 @@ cond_broadcast (struct condition *cond, struct lock *lock)
   while (!list_empty (&cond->waiters))
     cond_signal (cond, lock);
 }
+
+/* Initializes RW as unheld. */
+void
+rw_init (struct rwlock *rw)
+{
+  ASSERT (rw != NULL);
+
+  lock_init (&rw->lock);
+  cond_init (&rw->readers_ok);
+  cond_init (&rw->writers_ok);
+  rw->readers = 0;
+  rw->waiting_readers = 0;
+  rw->waiting_writers = 0;
+  rw->admitted = 0;
+  rw->read_gen = 0;
+  rw->writer = NULL;
+
+  #ifdef DEBUG_LOCK
+    rw->id = 0;
+  #endif
+}
+
+/* Acquires RW for reading, sleeping while a writer holds it or
+   is waiting for it.  The current thread must not hold RW for
+   writing.  Like lock_acquire(), must not be called within an
+   interrupt handler. */
+void
+rw_read_acquire (struct rwlock *rw)
+{
+  #ifdef DEBUG_LOCK
+    if(rw == NULL || intr_context () || rw_write_held_by_current_thread (rw))
+      printf("rwlock %d fails \n", rw->id);
+  #endif
+
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rw_write_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  if (rw->writer != NULL || rw->waiting_writers > 0)
+    {
+      unsigned gen = rw->read_gen;
+
+      rw->waiting_readers++;
+      while (rw->writer != NULL
+             || (rw->waiting_writers > 0 && gen == rw->read_gen))
+        cond_wait (&rw->readers_ok, &rw->lock);
+      rw->waiting_readers--;
+      if (gen != rw->read_gen)
+        rw->admitted--;
+    }
+  rw->readers++;
+  lock_release (&rw->lock);
+}
+
+/* Acquires RW for reading if no writer holds it or waits for it.
+   Returns true if successful. */
+bool
+rw_read_try_acquire (struct rwlock *rw)
+{
+  bool success;
+
+  ASSERT (rw != NULL);
+  ASSERT (!rw_write_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  success = rw->writer == NULL && rw->waiting_writers == 0;
+  if (success)
+    rw->readers++;
+  lock_release (&rw->lock);
+  return success;
+}
+
+/* Releases RW, which the current thread holds for reading. */
+void
+rw_read_release (struct rwlock *rw)
+{
+  ASSERT (rw != NULL);
+
+  lock_acquire (&rw->lock);
+  ASSERT (rw->readers > 0);
+  if (--rw->readers == 0 && rw->waiting_writers > 0)
+    cond_signal (&rw->writers_ok, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Acquires RW for writing, sleeping until no reader or writer
+   holds it and every reader handed the lock by the previous
+   writer has had its turn.  Must not already be held by the
+   current thread in either mode. */
+void
+rw_write_acquire (struct rwlock *rw)
+{
+  #ifdef DEBUG_LOCK
+    if(rw == NULL || intr_context () || rw_write_held_by_current_thread (rw))
+      printf("rwlock %d fails \n", rw->id);
+  #endif
+
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rw_write_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  rw->waiting_writers++;
+  while (rw->writer != NULL || rw->readers > 0 || rw->admitted > 0)
+    cond_wait (&rw->writers_ok, &rw->lock);
+  rw->waiting_writers--;
+  rw->writer = thread_current ();
+  lock_release (&rw->lock);
+}
+
+/* Acquires RW for writing if nobody holds it.  Returns true if
+   successful. */
+bool
+rw_write_try_acquire (struct rwlock *rw)
+{
+  bool success;
+
+  ASSERT (rw != NULL);
+  ASSERT (!rw_write_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  success = rw->writer == NULL && rw->readers == 0 && rw->admitted == 0;
+  if (success)
+    rw->writer = thread_current ();
+  lock_release (&rw->lock);
+  return success;
+}
+
+/* Releases RW, which the current thread holds for writing.
+   Readers that were waiting get the lock first, then the next
+   writer. */
+void
+rw_write_release (struct rwlock *rw)
+{
+  #ifdef DEBUG_LOCK
+    if(rw == NULL || !rw_write_held_by_current_thread (rw))
+      printf("rwlock %d fails \n", rw->id);
+  #endif
+
+  ASSERT (rw != NULL);
+  ASSERT (rw_write_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  rw->writer = NULL;
+  if (rw->waiting_readers > 0)
+    {
+      rw->read_gen++;
+      rw->admitted = rw->waiting_readers;
+      cond_broadcast (&rw->readers_ok, &rw->lock);
+    }
+  else if (rw->waiting_writers > 0)
+    cond_signal (&rw->writers_ok, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Returns true if the current thread holds RW for writing.
+   There is no equivalent for readers, which are not tracked
+   individually. */
+bool
+rw_write_held_by_current_thread (const struct rwlock *rw)
+{
+  ASSERT (rw != NULL);
+
+  return rw->writer == thread_current ();
+}
+
+/* Initializes SL. */
+void
+seq_init (struct seqlock *sl)
+{
+  ASSERT (sl != NULL);
+
+  sl->seq = 0;
+  lock_init (&sl->lock);
+}
+
+/* Starts a read of the data protected by SL and returns the
+   sequence number to pass to seq_read_retry().  While a write is
+   in progress, waits for the writer's lock rather than spinning,
+   so a writer of lower priority still gets to finish. */
+unsigned
+seq_read_begin (const struct seqlock *sl)
+{
+  struct lock *writer_lock = (struct lock *) &sl->lock;
+  unsigned seq;
+
+  ASSERT (sl != NULL);
+
+  for (;;)
+    {
+      seq = *(volatile const unsigned *) &sl->seq;
+      if ((seq & 1) == 0)
+        break;
+      lock_acquire (writer_lock);
+      lock_release (writer_lock);
+    }
+  barrier ();
+  return seq;
+}
+
+/* Returns true if a write happened since seq_read_begin()
+   returned START, in which case the read must be redone. */
+bool
+seq_read_retry (const struct seqlock *sl, unsigned start)
+{
+  ASSERT (sl != NULL);
+
+  barrier ();
+  return *(volatile const unsigned *) &sl->seq != start;
+}
+
+/* Starts a write of the data protected by SL. */
+void
+seq_write_begin (struct seqlock *sl)
+{
+  ASSERT (sl != NULL);
+
+  lock_acquire (&sl->lock);
+  sl->seq++;
+  barrier ();
+}
+
+/* Ends a write started with seq_write_begin(). */
+void
+seq_write_end (struct seqlock *sl)
+{
+  ASSERT (sl != NULL);
+  ASSERT (lock_held_by_current_thread (&sl->lock));
+
+  barrier ();
+  sl->seq++;
+  lock_release (&sl->lock);
+}
@@ -55,6 +55,50 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock.  Writers are preferred: once a writer
+   waits, new readers queue behind it.  A releasing writer hands
+   the lock to every reader that was already waiting before the
+   next writer gets it, so readers cannot starve either. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition readers_ok; /* Signaled when readers may enter. */
+    struct condition writers_ok; /* Signaled when a writer may enter. */
+    unsigned readers;           /* Threads holding it for reading. */
+    unsigned waiting_readers;   /* Readers waiting to enter. */
+    unsigned waiting_writers;   /* Writers waiting to enter. */
+    unsigned admitted;          /* Waiting readers handed the lock. */
+    unsigned read_gen;          /* Bumped on every hand-off. */
+    struct thread *writer;      /* Thread holding it for writing. */
+#ifdef DEBUG_LOCK
+    int id;
+#endif
+  };
+
+void rw_init (struct rwlock *);
+void rw_read_acquire (struct rwlock *);
+bool rw_read_try_acquire (struct rwlock *);
+void rw_read_release (struct rwlock *);
+void rw_write_acquire (struct rwlock *);
+bool rw_write_try_acquire (struct rwlock *);
+void rw_write_release (struct rwlock *);
+bool rw_write_held_by_current_thread (const struct rwlock *);
+
+/* Sequence lock.  Writers serialize on a lock and bump the
+   sequence number before and after writing; readers never block
+   writers, they retry if the number changed under them. */
+struct seqlock
+  {
+    unsigned seq;               /* Odd while a write is in progress. */
+    struct lock lock;           /* Serializes writers. */
+  };
+
+void seq_init (struct seqlock *);
+unsigned seq_read_begin (const struct seqlock *);
+bool seq_read_retry (const struct seqlock *, unsigned start);
+void seq_write_begin (struct seqlock *);
+void seq_write_end (struct seqlock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
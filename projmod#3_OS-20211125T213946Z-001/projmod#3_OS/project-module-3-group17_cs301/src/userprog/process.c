@@ -312,13 +312,11 @@ bool load(struct args_struct *filenameargument, void (**eip)(void), void **esp)
   process_activate();
 
   /* Open executable currentFile. */
-  lock_fs();
   currentFile = filesys_open(filenameargument->file_name);
   if (currentFile == NULL)
   {
     printf("load: %s: open failed\n", filenameargument->file_name);
     file_close(currentFile);
-    unlock_fs();
 
     goto done;
   }
@@ -326,7 +324,6 @@ bool load(struct args_struct *filenameargument, void (**eip)(void), void **esp)
   {
     currentThread->run_file = currentFile;
     file_deny_write(currentFile);
-    unlock_fs();
   }
 
   /* Read and verify executable header. */
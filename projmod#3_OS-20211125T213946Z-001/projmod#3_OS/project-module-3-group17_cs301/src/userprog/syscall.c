@@ -1,11 +1,13 @@
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 #include "filesys/fsaccess.h"
+#include "filesys/cache.h"
 #include "userprog/process.h"
 #include "syscall.h"
 #include "devices/shutdown.h"
 #include "userprog/syscall.h"
 #include <stdio.h>
+#include <string.h>
 #include <syscall-nr.h>
 
 
@@ -31,6 +33,7 @@ static bool isdir (int fno);
 static int mmap (int fno, void *pg);
 static void munmap (int m_id);
 static int inumber (int fno);
+static bool cache_stats (struct cache_stats *st, void *fesp);
 
 #define CHECK_PTR(esp, wants_to_write) \
 {\
@@ -182,6 +185,11 @@ static void syscall_handler (struct intr_frame *frm)
 
       frm->eax = inumber (fno);
     break;
+    case SYS_CACHESTATS:
+      buff = GET_PARAM(fesp, void *);
+
+      frm->eax = cache_stats (buff, frm->esp);
+    break;
   }
 }
 static void exit (int status)
@@ -264,6 +272,18 @@ static int inumber (int fno)
   return fd_inode_number (fno);
 }
 
+static bool cache_stats (struct cache_stats *st, void *fesp)
+{
+  struct cache_stats snapshot;
+
+  CHECK_PTR_RANGE(st, st + 1, true, fesp);
+  /* Take the snapshot first: touching user memory may fault and
+     must not happen under the cache locks. */
+  bc_get_stats (&snapshot);
+  memcpy (st, &snapshot, sizeof snapshot);
+  return true;
+}
+
 static bool mkdir (const char *direc)
 {
   CHECK_PTR(direc, false);
@@ -168,7 +168,7 @@ bool page_out_evicted_frame (struct frame_entry *fe)
       if(pagedir_is_dirty (fe->owner->pagedir, pt->vaddr))
       {
         lock_acquire (&frame_fs_lock);
-        file_write_at (pt->file_info->file, pt->vaddr, 
+        file_write_at (pt->file_info->file, fe->page, 
           pt->file_info->read_bytes, pt->file_info->offset);
         lock_release (&frame_fs_lock);
       }
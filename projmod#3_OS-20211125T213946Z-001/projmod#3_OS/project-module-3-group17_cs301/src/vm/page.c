@@ -32,9 +32,7 @@ int
 pt_suppl_handle_mmap (struct file *fe, void *start_pg)
 {
   struct thread *current = thread_current ();
-  lock_fs ();
   off_t len = file_length (fe);
-  unlock_fs ();
   int left;
   bool error = false;
   if (len == 0)
@@ -111,9 +109,7 @@ void pt_suppl_handle_unmap (int map_id)
     }
   if(file_to_close)
   {
-    lock_fs ();
     file_close (file_to_close);
-    unlock_fs ();
   }
 }
 
@@ -196,10 +192,15 @@ void pt_suppl_flush_mmf (struct pt_suppl_entry *entry)
      entry->status == MMF_SWAPPED)
     {
       struct pt_suppl_file_info *mmfile = entry->file_info;
+      void *kpage = pagedir_get_page (thread_current ()->pagedir,
+                                      entry->vaddr);
       ASSERT (mmfile != NULL);
 
+      /* Write from the frame's kernel address when it is present,
+         so that a whole page can bypass the buffer cache. */
       file_seek (mmfile->file, mmfile->offset);
-      file_write (mmfile->file, entry->vaddr, mmfile->read_bytes);
+      file_write (mmfile->file, kpage != NULL ? kpage : entry->vaddr,
+                  mmfile->read_bytes);
     }
 }
 
@@ -259,7 +260,7 @@ bool pt_suppl_page_in (struct pt_suppl_entry *entry)
         vm_frame_free (frm);
         return false;
       }
-      swap_in (entry->swap_slot, entry->vaddr);
+      swap_in (entry->swap_slot, frm);
 
       if(GET_TYPE(entry->status) == LAZY)
         {
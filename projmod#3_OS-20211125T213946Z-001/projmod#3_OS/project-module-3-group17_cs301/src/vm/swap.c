@@ -16,19 +16,15 @@ struct lock swap_lock;
 
 
 
+/* Reads SLOT into PG, the kernel address of the frame, and frees
+   it.  The slot belongs to the caller, so swap_lock is only taken
+   to update the bitmap. */
 void swap_in (size_t slot, void* pg)
 {
-  lock_acquire (&swap_lock);
   size_t swap_addr_base = slot * SECTORS_PER_PAGE;
-  for (size_t iter = 0; iter < SECTORS_PER_PAGE; iter++)
-    {
-      block_sector_t from = swap_addr_base + iter;
-      void* tooo = pg + iter * BLOCK_SECTOR_SIZE;
-      lock_fs ();
-      block_read (swap_device, from, tooo);
-      unlock_fs ();
-    }
+  block_read_multiple (swap_device, swap_addr_base, SECTORS_PER_PAGE, pg);
 
+  lock_acquire (&swap_lock);
   swap_free (slot);
   lock_release (&swap_lock);
 }
@@ -55,24 +51,16 @@ size_t swap_out (const void* pg)
 {
   lock_acquire (&swap_lock);
   size_t s = bitmap_scan_and_flip (swap_bm, 0, 1, true);
+  lock_release (&swap_lock);
 
   if (s != BITMAP_ERROR)
     {
       size_t swap_addr = s * SECTORS_PER_PAGE;
-      lock_fs ();
-      for (size_t iter = 0; iter < SECTORS_PER_PAGE; iter++)
-        {
-          const void* from = pg + iter * BLOCK_SECTOR_SIZE;
-          block_sector_t tooo = swap_addr + iter;
-          block_write (swap_device, tooo, from);
-        }
-      unlock_fs ();
-      lock_release (&swap_lock);
+      block_write_multiple (swap_device, swap_addr, SECTORS_PER_PAGE, pg);
       return s;  
     }
   else
     {
-      lock_release (&swap_lock);
       return SWAP_ERROR;
     }
 }